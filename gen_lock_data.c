@@ -0,0 +1,222 @@
+/*
+ * Generate a synthetic bpftrace data file in the format produce_lock_info
+ * expects, so the reducer can be timed without having to run bpftrace.
+ *
+ * usage:  gen_lock_data
+ *   -c <value>: frame cardinality, the number of different frames seen at each level
+ *      of the stacks, default = 16
+ *   -d <value>: stack depth, the frames below mutex_lock, default = 8
+ *   -n <value>: number of unique stacks to generate, default = 10000
+ *   -o <pathname>: file to write, if none output goes to stdout.
+ *   -r <value>: seed for the random values, default = 1
+ *   -s: write the stats() sections of the current scripts (count, average and total
+ *      in one map, then the max) instead of the six avg/max/count sections of the
+ *      older ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#define STACK_DEPTH 8
+#define FRAME_CARDINALITY 16
+
+/* What write_section() writes of each stack */
+#define FIELD_AVG 0
+#define FIELD_MAX 1
+#define FIELD_COUNT 2
+#define FIELD_STATS 3
+
+#define SECTION_BAR "========================================"
+
+/*
+ * Per stack values, acquire data is stored first then the hold data.
+ */
+struct gen_values {
+	long count[2];
+	long avg[2];
+	long max[2];
+};
+
+static const char *frame_names[] = {
+	"kernfs_iop_permission", "kernfs_dop_revalidate", "kernfs_iop_getattr",
+	"kernfs_iop_get_link", "kernfs_iop_lookup", "ext4_file_write_iter",
+	"ext4_buffered_write_iter", "pipe_read", "pipe_write", "do_last",
+	"path_openat", "do_filp_open", "do_sys_open", "vfs_read", "vfs_write",
+	"ksys_read", "ksys_write", "lookup_slow", "walk_component",
+	"link_path_walk", "filename_lookup", "vfs_statx", "do_syscall_64",
+	"entry_SYSCALL_64_after_hwframe"
+};
+
+#define NUMBER_FRAME_NAMES (sizeof (frame_names) / sizeof (frame_names[0]))
+
+static int stack_depth = STACK_DEPTH;
+static size_t frame_cardinality = FRAME_CARDINALITY;
+
+/*
+ * Write frame 'level' of stack 'stack'.  The frames are picked from the digits
+ * of the stack number, so every stack is unique while the frames nearest
+ * mutex_lock are shared the way they are in real captures.
+ */
+static void
+write_frame(FILE *fd, size_t stack, int level)
+{
+	size_t digit = stack;
+	int count;
+
+	for (count = 0; count < level; count++)
+		digit /= frame_cardinality;
+	digit %= frame_cardinality;
+	fprintf(fd, "        %s+%zu\n",
+	    frame_names[(digit + level) % NUMBER_FRAME_NAMES], 17 + digit * 4 + level);
+}
+
+/*
+ * Write one bpftrace map section.
+ */
+static void
+write_section(FILE *fd, const char *title, const char *map, struct gen_values *values,
+    size_t number_stacks, int which, int field)
+{
+	size_t stack;
+	int level;
+	long value;
+
+	fprintf(fd, "%s\n%s\n%s\n", SECTION_BAR, title, SECTION_BAR);
+	for (stack = 0; stack < number_stacks; stack++) {
+		fprintf(fd, "@%s[\n", map);
+		fprintf(fd, "        mutex_lock+1\n");
+		for (level = 0; level < stack_depth; level++)
+			write_frame(fd, stack, level);
+		if (field == FIELD_STATS) {
+			fprintf(fd, "]: count %ld, average %ld, total %ld\n", values[stack].count[which],
+			    values[stack].avg[which], values[stack].count[which] * values[stack].avg[which]);
+			continue;
+		}
+		if (field == FIELD_AVG)
+			value = values[stack].avg[which];
+		else if (field == FIELD_MAX)
+			value = values[stack].max[which];
+		else
+			value = values[stack].count[which];
+		fprintf(fd, "]: %ld\n", value);
+	}
+	fprintf(fd, "\n");
+}
+
+static void
+usage(char *execname)
+{
+	fprintf(stderr, "usage %s:\n", execname);
+	fprintf(stderr, "\t-c <#>: frame cardinality, frames seen at each level, default %d\n",
+	    FRAME_CARDINALITY);
+	fprintf(stderr, "\t-d <#>: stack depth, default %d\n", STACK_DEPTH);
+	fprintf(stderr, "\t-h: help message\n");
+	fprintf(stderr, "\t-n <#>: number of unique stacks, default 10000\n");
+	fprintf(stderr, "\t-o <file name>: output file\n");
+	fprintf(stderr, "\t-r <#>: random seed, default 1\n");
+	fprintf(stderr, "\t-s: write stats() sections, instead of the older avg/max/count ones\n");
+	exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE *fd = stdout;
+	struct gen_values *values;
+	size_t number_stacks = 10000;
+	size_t stack;
+	size_t possible;
+	char *output_file = NULL;
+	unsigned int seed = 1;
+	int stats_format = 0;
+	int level;
+	int which;
+	int value;
+
+	while ((value = getopt(argc, argv, "c:d:hn:o:r:s")) != -1) {
+		switch(value) {
+			case 'c':
+				frame_cardinality = strtoul(optarg, NULL, 10);
+			break;
+			case 'd':
+				stack_depth = atoi(optarg);
+			break;
+			case 'n':
+				number_stacks = strtoul(optarg, NULL, 10);
+			break;
+			case 'o':
+				output_file = optarg;
+			break;
+			case 'r':
+				seed = (unsigned int) atoi(optarg);
+			break;
+			case 's':
+				stats_format = 1;
+			break;
+			case 'h':
+			default:
+				usage(argv[0]);
+			break;
+		}
+	}
+
+	if (stack_depth < 1 || frame_cardinality < 1) {
+		fprintf(stderr, "The stack depth and frame cardinality have to be at least 1\n");
+		usage(argv[0]);
+	}
+	/* The stacks are the stack numbers written in base frame_cardinality */
+	for (level = 0, possible = 1; level < stack_depth && possible < number_stacks; level++)
+		possible *= frame_cardinality;
+	if (possible < number_stacks) {
+		fprintf(stderr, "Only %zu unique stacks of depth %d with a frame cardinality of %zu\n",
+		    possible, stack_depth, frame_cardinality);
+		exit(EXIT_FAILURE);
+	}
+
+	if (output_file) {
+		fd = fopen(output_file, "w");
+		if (fd == NULL) {
+			perror(output_file);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	values = (struct gen_values *) malloc(sizeof (struct gen_values) * (number_stacks + 1));
+	if (values == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	srandom(seed);
+	for (stack = 0; stack < number_stacks; stack++) {
+		for (which = 0; which < 2; which++) {
+			values[stack].count[which] = 1 + random() % 5000;
+			values[stack].avg[which] = 100 + random() % 100000;
+			values[stack].max[which] = values[stack].avg[which] + random() % 1000000;
+		}
+	}
+
+	fprintf(fd, "Attaching 3 probes...\n");
+	if (stats_format) {
+		write_section(fd, "mutex aq stats", "aq_report_stats", values, number_stacks, 0, FIELD_STATS);
+		write_section(fd, "mutex aq max", "aq_report_max", values, number_stacks, 0, FIELD_MAX);
+		write_section(fd, "mutex hold stats", "hl_report_stats", values, number_stacks, 1, FIELD_STATS);
+		write_section(fd, "mutex hold max", "hl_report_max", values, number_stacks, 1, FIELD_MAX);
+	} else {
+		write_section(fd, "mutex aq _averages", "aq_report_avg", values, number_stacks, 0, FIELD_AVG);
+		write_section(fd, "mutex aq max", "aq_report_max", values, number_stacks, 0, FIELD_MAX);
+		write_section(fd, "mutex aq count", "aq_report_count", values, number_stacks, 0, FIELD_COUNT);
+		write_section(fd, "mutex hold avg", "hl_report_avg", values, number_stacks, 1, FIELD_AVG);
+		write_section(fd, "mutex hold max", "hl_report_max", values, number_stacks, 1, FIELD_MAX);
+		write_section(fd, "mutex hold count", "hl_report_count", values, number_stacks, 1, FIELD_COUNT);
+	}
+	fprintf(fd, "=======================================\n");
+	fprintf(fd, "END OF DATA\n");
+	fprintf(fd, "=======================================\n");
+
+	if (fd != stdout)
+		(void) fclose(fd);
+	free(values);
+	return(0);
+}
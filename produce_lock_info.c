@@ -11,16 +11,82 @@
  *     6) Maximum time the lock is held for.
  *
  * Note: we do not have the actual lock name, we have the entry point it was called from.
+ * With -l the address of the lock is recorded as well.
  *
  * Once the data is acquired, the program then reduces the data to a summary of information.
  * The data is sorted by total acquistion time.
  *
  * usage:  produce_lock_info
+ *   -b <kprobe|contention>: what the bpftrace script traces with.  kprobe (the default)
+ *      probes every mutex_lock and mutex_unlock.  contention uses the
+ *      lock:contention_begin/end tracepoints, which only fire when a mutex is contended,
+ *      much cheaper on a busy system but there is no hold time.
  *   -c <command>: command to be executed.
- *   -f <pathname>: fle where bpftrace data is stored.
+ *   -D <pathname>: compare with this baseline capture (given more than once, merged),
+ *      the -f captures (or the default data file) being the candidate.  The call sites
+ *      are matched at the -s depth and ranked on how much worse their total acquire
+ *      time got, -S hold options rank on the hold time, -S 1 and 5 on the tail
+ *      latency (p99 with -H, the maximum otherwise).  New and gone call sites are flagged.
+ *   -d: have bpftrace keep the sums of the squares of the times as well, and report the
+ *      standard deviation of the acquire and hold times of each caller.
+ *   -F <csv|json|folded>: write the report in this format instead of text, for
+ *      dashboards and diff tools.  csv (with a header line) and json (an object a
+ *      line) have a row for each caller, with its whole stack (from the caller out)
+ *      and every field, the totals included.  folded has a line for each caller, its
+ *      stack from the outermost frame in, weighted by the hold time when sorting
+ *      (-S) on a hold field, the acquire time otherwise, as flamegraph.pl takes.
+ *      -C, -n and -s apply as they do to the text report.
+ *   -f <pathname>: fle where bpftrace data is stored.  With -c, the bpftrace data is
+ *      reduced as it arrives and is only saved to the file if -f is given.  Given more
+ *      than once, or followed by more file names, the captures (from several hosts say)
+ *      are merged into the one report, each read and let go in turn.
+ *   -G <cgroup path>: only trace the tasks in the cgroup, checked first thing in
+ *      every probe so the rest of the system costs next to nothing.
+ *   -g <pathname>: write the call tree out as folded stacks, for flamegraph.pl.
+ *   -H <bits>: keep a latency histogram per stack, for acquire and hold times, and
+ *      report the p50, p90, p99 and p99.9 of each caller.  The histograms are log-linear,
+ *      2^bits buckets per power of 2 (bpftrace hist(x, bits)), 0 is plain log2 for
+ *      bpftrace versions without it.
  *   -h: help message
+ *   -i <secs>: report on each interval of secs seconds.  Without -c or -f, trace until
+ *      interrupted.
+ *   -j <threads>: reduce the data file (-f) with this many threads, 0 for one per
+ *      CPU.  The sections are cut up and parsed in parallel, each thread into tables
+ *      of its own, which are then merged by stack, again in parallel.  Merging several
+ *      captures, the captures are shared out between the threads instead.  Not used
+ *      when reporting by interval, or with -m.
+ *   -k <pathname>: kallsyms file used to resolve raw stacks and locks, default /proc/kallsyms.
+ *   -l: key the data by the address of the mutex as well, and report the hot locks
+ *      each followed by the callers contending on it.
+ *   -m <entries>: stack budget, keep at most entries stacks while reducing.  Once
+ *      full, a new stack with more acquire time than the lightest one kept replaces
+ *      it, the lighter of the two is folded into an [other] row (Space-Saving).  From
+ *      a single capture the stacks kept are the heaviest.  Each row reports, as ACQs
+ *      Err, the most acquire time of its own that may have gone into [other] in
+ *      earlier captures.  Bounds the memory used on long or busy captures.
  *   -o <pathname>: file to save the results to, if no output goes to stdout.
- *   -s <value>: how much of the stack to show and present data on, default = 1
+ *   -P <value>: sample, only the stacks of 1 in value acquisitions are captured.  The
+ *      counts by stack are scaled up, and marked as estimates.
+ *   -p: only trace the -c command and the processes it forks.  The command is
+ *      started once bpftrace is, and its pid tree followed by the fork/exit tracepoints.
+ *   -R: key the data by capture (-f) as well, the Run column naming the capture.
+ *   -r: record raw stack addresses, and resolve them here instead of in bpftrace.
+ *   -s <value>[-<value>]: how much of the stack to show and present data on, default = 1.
+ *      With a range, a report is produced for each depth from the one parse of the data.
+ *   -T <ns>: only acquisitions and holds taking at least ns are aggregated by stack.
+ *      With -P or -T, the count and total of every acquisition and hold is still kept.
+ *      With -b contention, only the stacks of the waits that long are taken, the kprobe
+ *      backend still takes the stack of every mutex_lock, the holds are keyed by it.
+ *   -t: report a call tree of the callers, from the outermost frame in, with the times
+ *      at each frame inclusive of everything under it.  -s limits the levels shown.
+ *   -V <pathname>: append the -v stats to the file, as a JSON object on a line of its
+ *      own, to track the cost of reducing from run to run.
+ *   -v: report, on stderr at the end, what the reduction cost: the wall and CPU time of
+ *      each phase (script generation, trace run, parse, organize and dump), the lines,
+ *      bytes and time of each section parsed, the unique stacks, frames and callers,
+ *      the arena blocks and heap used and the peak RSS.
+ *   -w <pathname>: save the reduced data as a binary snapshot, which -f then loads
+ *      (mapped, the stacks used in place) instead of parsing the bpftrace output again.
  *
  * Example output:
  *
@@ -43,10 +109,26 @@
 #include <strings.h>
 #include <signal.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <malloc.h>
 
 #define DATA_FILE "/tmp/lock_data.out"
 #define BPFTRACE "/tmp/lock_tracker.bt"
-#define _SIGRTMAX SIGRTMAX-2 + 1
+#define KALLSYMS "/proc/kallsyms"
+/* How far past a data symbol a lock may lie and still be named by it */
+#define LOCK_SYMBOL_RANGE (1024 * 1024)
+/* Printed by the BEGIN probe once every probe is attached */
+#define READY_LINE "LOCK TRACKER READY"
 
 /*
  * Indexes into the lock data array.
@@ -60,74 +142,490 @@
 #define HD_DATA_HOLD_COUNT 6
 #define HD_DATA_TOTAL_TIME 7
 
+/* The data index of field (an ACQ_DATA_* index) for the hold times when which is TIME_HOLD */
+#define DATA_INDEX(which, field) ((field) + (which) * (HD_DATA_HOLD_AVG - ACQ_DATA_HOLD_AVG))
+
+/* The -S options, indices in sort_routines[] */
 #define HOLDS 0
 #define HOLDS_MAX 1
 #define HOLDS_AVG 2
-#define ACQS 3
-#define ACQS_MAX 4
-#define ACQS_AVG 5
-#define ACQS_SPENT 6
+#define HOLDS_SPENT 3
+#define ACQS 4
+#define ACQS_MAX 5
+#define ACQS_AVG 6
+#define ACQS_SPENT 7
+
+/*
+ * Which of the acquire times (TIME_ACQ) or hold times (TIME_HOLD) the per time arrays
+ * below are indexed by.
+ */
+#define TIME_ACQ 0
+#define TIME_HOLD 1
+
+/*
+ * Sums of times, kept in 128 bits so they neither drift nor overflow however many
+ * acquisitions are added up.
+ */
+typedef __int128 lock_sum;
+
+/*
+ * Latency histogram of a stack (-H), of the acquire times and of the hold times.  The
+ * buckets are kept the way bpftrace printed them, [low, high), sorted on low.  Whatever
+ * scale the capture used (hist(x) or hist(x, k)), the histograms of the same capture
+ * have the same buckets, and so merge exactly.  percentiles is only filled in for the
+ * consolidated entries.
+ */
+#define NUMBER_PERCENTILES 4
+
+struct hist_bucket {
+	long low;
+	long high;
+	long count;
+};
+
+struct lock_hist {
+	struct hist_bucket *buckets[2];
+	size_t number[2];
+	size_t size[2];
+	long percentiles[2][NUMBER_PERCENTILES];
+};
 
 /*
- * lock information structure.  The contents of called_from is determined by the -s option.
+ * lock information structure.  The stack is held as an array of frame IDs (see
+ * frame_data), frames[0] being mutex_lock itself.  called_from is only filled in for
+ * the consolidated entries, where frames points into the stack of the first entry
+ * consolidated, and the contents is determined by the -s option.  lock is the address
+ * of the mutex when the data is keyed by lock as well (-l), 0 otherwise.  hist is only
+ * there when the data has histograms.
+ * The exact sums of the times (total) and of their squares (squares, -d) are what is
+ * added up, the averages and totals in data and the standard deviations (stddev) are
+ * worked out from them once, by finish_data(), when the adding up is done.
+ * error is only used with a stack budget (-m), the most acquire time the stack may
+ * have had folded into other_data before it was (last) given an entry.
+ * run is the capture (-f) the data came from when keyed by capture (-R), numbered from
+ * 1, 0 otherwise (and for the rows that add up several captures).
  */
 struct lock_info {
-	char *stack;
+	unsigned int *frames;
+	size_t number_frames;
+	unsigned long lock;
+	unsigned int run;
 	char *called_from;
+	unsigned long hash;
 	long data[8];
+	lock_sum total[2];
+	lock_sum squares[2];
+	long stddev[2];
+	lock_sum error;
+	struct lock_hist *hist;
+};
+
+/*
+ * A unique frame (function+offset) seen in the stacks.  The ID of a frame is its index
+ * in frame_data.  Each frame name is copied once, when first seen, so nothing refers
+ * back into the data being parsed.  lock_frame is set for the frames of the mutex
+ * code itself (mutex_*, __mutex_*).
+ */
+struct frame_info {
+	char *name;
+	size_t length;
+	unsigned long hash;
+	int lock_frame;
+};
+
+/*
+ * Bump allocator for the many small pieces (frame names, stacks, called_from strings)
+ * that all go away together, if at all.  Memory is handed out from blocks of at least
+ * ARENA_BLOCK bytes, a reset keeps the blocks to hand out again.
+ */
+#define ARENA_BLOCK (1024 * 1024)
+#define ARENA_ALIGN 8
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+};
+
+struct arena {
+	struct arena_block *first;
+	struct arena_block *current;
+};
+
+/* How far into a stack the mutex code may start */
+#define LOCK_FRAMES_MAX 8
+
+#define PARSE_CHUNK (64 * 1024 * 1024)
+
+#define SECTION_END -2
+#define SECTION_AQ_STATS -3
+#define SECTION_HD_STATS -4
+#define SECTION_SAMPLING -5
+#define SECTION_AQ_ALL -6
+#define SECTION_HD_ALL -7
+#define SECTION_AQ_HIST -8
+#define SECTION_HD_HIST -9
+#define SECTION_AQ_SQ_HIGH -10
+#define SECTION_AQ_SQ_LOW -11
+#define SECTION_HD_SQ_HIGH -12
+#define SECTION_HD_SQ_LOW -13
+
+#define TITLE_NONE 0
+#define TITLE_EXPECTED 1
+#define TITLE_NEXT 2
+
+/*
+ * State of the parse of the bpftrace output.
+ * base: start of the buffer being parsed.
+ * index: data field of the section being read, -1 if the section is not of interest.
+ * title_state: where we are in a section header, a title between two lines of '='.
+ * end_of_data: if not NULL, called at the end of each report (interval) in the data.
+ * raw: the stack being parsed is made up of raw addresses, which are resolved to
+ *    their frames here.
+ * frames: IDs of the frames of the stack being parsed.
+ * lock: address of the mutex the stack being parsed is keyed by, if any.
+ * run: capture the data is from (-R), see lock_info.
+ * averages: the data has the averages by stack (old format), instead of stats.
+ * hist_entry: entry the buckets of the histogram being read are added to, if any.
+ */
+struct parse_state {
+	const char *base;
+	int index;
+	int title_state;
+	void (*end_of_data)(void);
+	int raw;
+	unsigned long lock;
+	unsigned int run;
+	int averages;
+	unsigned int *frames;
+	size_t number_frames;
+	size_t frames_size;
+	int ready;
+	struct lock_info *hist_entry;
+};
+
+/*
+ * bpftrace output read from the pipe that has not been parsed yet.  Only the tail of
+ * an incomplete stack is held between reads.
+ * tee_fd: file descriptor the raw output is also saved to, -1 if none.
+ */
+#define STREAM_READ_SIZE (1024 * 1024)
+
+struct stream_state {
+	struct parse_state ps;
+	char *buf;
+	size_t len;
+	size_t size;
+	int tee_fd;
+};
+
+/*
+ * Map the section titles printed by the bpftrace script to the data field they fill in.
+ * The stats sections fill in the count, average and total time all at once.  The avg
+ * and count sections are from older versions of the script, and are still recognized
+ * so that old data files can be reduced.
+ * Note, any change in format of the output file, needs to be reflected here.
+ */
+struct section_info {
+	const char *title;
+	int index;
+};
+
+static struct section_info sections[] = {
+	{ "mutex aq stats", SECTION_AQ_STATS },
+	{ "mutex hold stats", SECTION_HD_STATS },
+	{ "mutex sampling", SECTION_SAMPLING },
+	{ "mutex aq all", SECTION_AQ_ALL },
+	{ "mutex hold all", SECTION_HD_ALL },
+	{ "mutex aq hist", SECTION_AQ_HIST },
+	{ "mutex hold hist", SECTION_HD_HIST },
+	{ "mutex aq squares high", SECTION_AQ_SQ_HIGH },
+	{ "mutex aq squares low", SECTION_AQ_SQ_LOW },
+	{ "mutex hold squares high", SECTION_HD_SQ_HIGH },
+	{ "mutex hold squares low", SECTION_HD_SQ_LOW },
+	{ "mutex aq _averages", ACQ_DATA_HOLD_AVG },
+	{ "mutex aq max", ACQ_DATA_HOLD_MAX },
+	{ "mutex aq count", ACQ_DATA_HOLD_COUNT },
+	{ "mutex hold avg", HD_DATA_HOLD_AVG },
+	{ "mutex hold max", HD_DATA_HOLD_MAX },
+	{ "mutex hold count", HD_DATA_HOLD_COUNT },
+	{ "END OF DATA", SECTION_END },
+	{ NULL, -1 }
 };
 
+/*
+ * Sampling of the data, from the sampling section of the data (-P and -T when it was
+ * gathered).  The stack data is scaled up by sample_rate as it is read in.  totals
+ * holds the unkeyed count and total of every acquisition and hold, sampled or not.
+ * As the tables are, these are thread local, each capture of a merge may have been
+ * sampled differently (see merge_captures()).
+ */
+static __thread long sample_rate = 1;
+static __thread long sample_threshold = 0;
+static __thread long totals[8];
+static __thread lock_sum total_times[2];
+
+/*
+ * Set once histograms (-H) are seen in the data, the percentiles are then reported.
+ */
+static __thread int hist_data = 0;
+
+/*
+ * Set once the sums of the squares of the times (-d) are seen in the data, the
+ * standard deviations are then reported.
+ */
+static __thread int squares_data = 0;
+static const double percentile_values[NUMBER_PERCENTILES] = { 0.50, 0.90, 0.99, 0.999 };
+static const char *percentile_titles[NUMBER_PERCENTILES] = { "p50", "p90", "p99", "p99.9" };
+
 /*
  * Data for the entire lock information.  There will be one entry for each unique stack.
+ * lock_data_size is the number of entries allocated, grown geometrically.
+ * The tables the parse builds (lock_data, frame_data and their hash tables, arenas
+ * and address_table) are thread local, so that each thread of a parallel reduction
+ * (-j) builds its own, see parse_parallel().  The main thread's are the ones reported.
+ */
+static __thread struct lock_info *lock_data;
+static __thread size_t number_lock_entries = 0;
+static __thread size_t lock_data_size = 0;
+
+/*
+ * The stacks of the lock_data entries, thrown away with the entries.  With a stack
+ * budget (-m) entries come and go, their stacks are malloc()ed instead.
+ */
+static __thread struct arena stack_arena;
+
+/*
+ * Open addressed (linear probing) hash table indexing lock_data by stack.  Each slot
+ * holds the lock_data index + 1, 0 marks an empty slot.  The table size is a power
+ * of 2 and is doubled whenever it becomes half full.
+ */
+#define STACK_TABLE_MIN 1024
+static __thread size_t *stack_table;
+static __thread size_t stack_table_size = 0;
+
+/*
+ * Stack budget (-m), 0 for none.  With a budget, at most hh_budget stacks are kept,
+ * Space-Saving style: once full, a stack not seen before that brings more acquire time
+ * than the weight of the lightest stack kept (total + error) takes over its entry, the
+ * data of the lightest stack being folded into other_data, otherwise it is folded into
+ * other_data itself.  hh_heap is a min heap of the lock_data indices on that weight,
+ * hh_position where each entry is in it.  hh_folded counts the stacks folded into
+ * other_data.  Each stack is seen once per capture or interval (hh_epoch counts them,
+ * hh_seen is when each entry was last seen), so within one the stacks kept are exactly
+ * the heaviest.  hh_fold_max is the most acquire time any stack not kept may have in
+ * other_data, hh_prior_error the most a stack not kept that may still be seen in the
+ * capture or interval being read may have: a stack new to it is given that as its
+ * error.  The budget only applies to a serial reduction, other_data is thread local
+ * for the snapshots (-w) merged in parallel, which may have an [other] row of their
+ * own.
+ */
+static size_t hh_budget = 0;
+static size_t *hh_heap;
+static size_t *hh_position;
+static unsigned int *hh_seen;
+static unsigned int hh_epoch = 0;
+static __thread size_t hh_folded = 0;
+static __thread lock_sum hh_fold_max = 0;
+static __thread lock_sum hh_prior_error = 0;
+static __thread struct lock_info other_data;
+
+/*
+ * Every unique frame, indexed by frame_table the same way lock_data is by stack_table.
+ * Frames are kept across intervals, the set of kernel functions is bounded.  The frame
+ * names are in name_arena.
+ */
+static __thread struct frame_info *frame_data;
+static __thread size_t number_frame_entries = 0;
+static __thread size_t frame_data_size = 0;
+static __thread size_t *frame_table;
+static __thread size_t frame_table_size = 0;
+static __thread struct arena name_arena;
+
+/*
+ * Kernel text symbols, sorted by address, used to resolve raw stacks.  Each address
+ * seen is resolved once, and the frame ID (+ 1, 0 being empty) saved in address_table
+ * (open addressed, the same as stack_table).  The symbols are loaded once, whichever
+ * thread needs them first, their names are in symbol_arena.
+ */
+struct ksym {
+	unsigned long address;
+	char *name;
+};
+
+struct address_entry {
+	unsigned long address;
+	unsigned int frame;
+};
+
+static char *kallsyms_file = KALLSYMS;
+static struct ksym *ksyms;
+static size_t number_ksyms = 0;
+static pthread_once_t ksyms_once = PTHREAD_ONCE_INIT;
+static struct arena symbol_arena;
+static __thread struct address_entry *address_table;
+static __thread size_t address_table_size = 0;
+static __thread size_t number_addresses = 0;
+
+/*
+ * Kernel data symbols, sorted by address, used to name the static locks.
  */
-static struct lock_info *lock_data;
-static size_t number_lock_entries = 0;
+static struct ksym *dsyms;
+static size_t number_dsyms = 0;
 
 /*
- * Data that is consolidated based on called_from.
+ * Data that is consolidated based on the first frames (after mutex_lock) of the stack.
+ * The called_from strings are in called_from_arenas, one for each thread (-j) that
+ * consolidates, reset with each consolidation.
  */
 static struct lock_info *cons_data;
 static size_t number_cons_entries = 0;
+static struct arena *called_from_arenas;
 
 /*
- * Comparison routines for qsort and bsearch.
+ * Call tree of the stacks, a prefix trie running from the outermost frame down to the
+ * caller of mutex_lock.  Node 0 is the root, holding the totals of every stack.  The
+ * data of each node is inclusive, covering every stack that runs through the frame,
+ * self_time holds the acquire and hold time of the stacks calling mutex_lock directly
+ * from the frame.  Children are chained through first_child and next_sibling, and are
+ * located by (parent, frame) through tree_table, laid out the same as stack_table.
  */
+struct tree_node {
+	unsigned int frame;
+	size_t parent;
+	size_t first_child;
+	size_t next_sibling;
+	unsigned long hash;
+	long data[8];
+	lock_sum total[2];
+	lock_sum self_time[2];
+};
 
-static int
-locate_caller(const void *caller_ptr, const void *li_ptr)
-{
-        char *caller = (char *) caller_ptr;
-        struct lock_info *li = (struct lock_info *) li_ptr;
+static struct tree_node *tree_data;
+static size_t number_tree_nodes = 0;
+static size_t tree_data_size = 0;
+static size_t *tree_table;
+static size_t tree_table_size = 0;
 
-        return (strcmp(caller, li->called_from));
-}
+/*
+ * How the report is to be produced, from the command line.  Needed when reporting
+ * each interval as its data arrives.
+ */
+struct report_options {
+	FILE *fd;
+	char *caller;
+	int sort_option;
+	int secondary_sort;
+	int numb_to_show;
+	int intervals;
+	int first_depth;
+	int last_depth;
+	int tree;
+	int tree_depth;
+	char *folded_file;
+	int locks;
+	int diff;
+	int format;
+};
 
-static int
-locate_stack(const void *stack_ptr, const void *li_ptr)
-{
-        char *stack = (char *) stack_ptr;
-        struct lock_info *li = (struct lock_info *) li_ptr;
+static struct report_options report;
 
-        return (strcmp(stack, li->stack));
-}
+/*
+ * What the reduction costs, reported with -v (and -V).  The wall and CPU time (of the
+ * whole process) of each phase: generating the bpftrace script, the trace run,
+ * reading the data in (parsing, loading and merging), consolidating it
+ * (organize_data(), building the call tree) and writing the reports out.  The phases
+ * do not overlap, the time parsing the bpftrace output as it arrives or reporting on
+ * an interval is taken out of the phase it happens in.  items is what the phase
+ * went through: the stacks read in and consolidated, the rows reported on.
+ */
+#define PHASE_SCRIPT 0
+#define PHASE_TRACE 1
+#define PHASE_PARSE 2
+#define PHASE_ORGANIZE 3
+#define PHASE_DUMP 4
+#define NUMBER_PHASES 5
 
-static int
-sort_func(const void *l1_ptr, const void *l2_ptr)
-{
-        struct lock_info *l1 = (struct lock_info *) l1_ptr;
-        struct lock_info *l2 = (struct lock_info *) l2_ptr;
+struct phase_stats {
+	double wall;
+	double cpu;
+	double items;
+};
 
-        return (strcmp(l1->called_from, l2->called_from));
-}
+static const char *phase_names[NUMBER_PHASES] = { "script", "trace", "parse", "organize", "dump" };
+static struct phase_stats phase_stats[NUMBER_PHASES];
+static int current_phase = -1;
+static double phase_wall;
+static double phase_cpu;
 
-static int
-sort_stack(const void *l1_ptr, const void *l2_ptr)
-{
-        struct lock_info *l1 = (struct lock_info *) l1_ptr;
-        struct lock_info *l2 = (struct lock_info *) l2_ptr;
+/*
+ * The lines and bytes of each section of the bpftrace output parsed, and the wall and
+ * CPU time (of the thread) taken.  Every parse thread adds to them, so with -j the
+ * times are summed over the threads.  A section's slot is its index less
+ * SECTION_HD_SQ_LOW, the lines outside the known sections going to that of -1.
+ * input_bytes is the size of every data file and snapshot read, and of the bpftrace
+ * output.  stacks is the most unique stacks reported on at once (by interval, the
+ * tables start over), callers the number of consolidated entries last reported on.
+ */
+struct section_stats {
+	long lines;
+	long bytes;
+	long wall_ns;
+	long cpu_ns;
+};
 
-        return (strcmp(l1->stack, l2->stack));
-}
+/* Where a parse_buffer() call is up to in charging a section */
+struct section_mark {
+	const char *from;
+	long lines;
+	long wall_ns;
+	long cpu_ns;
+};
+
+#define SECTION_SLOT(index) ((index) - SECTION_HD_SQ_LOW)
+#define NUMBER_SECTION_SLOTS (SECTION_SLOT(HD_DATA_HOLD_COUNT) + 1)
+
+static struct section_stats section_stats[NUMBER_SECTION_SLOTS];
+static long input_bytes = 0;
+static size_t number_stacks = 0;
+static size_t number_callers = 0;
+static long arena_blocks = 0;
+static long arena_bytes = 0;
+static char *stats_file = NULL;
+static int verbose = 0;
+
+/*
+ * How the data is to be gathered, from the command line.
+ * backend: what the bpftrace script is built on, see bpftrace_create().
+ * sample: only the stacks of 1 in sample acquisitions are captured.
+ * threshold: only acquisitions or holds taking at least threshold ns are aggregated by
+ *    stack.  The contention backend only takes their stacks as well.
+ */
+#define BACKEND_KPROBE 0
+#define BACKEND_CONTENTION 1
+
+/* lock:contention_begin flags, the lock is a mutex */
+#define LCB_F_MUTEX (1 << 5)
+
+struct trace_options {
+	int interval;
+	int raw;
+	int locks;
+	int backend;
+	int sample;
+	long threshold;
+	int pid_tree;
+	char *cgroup;
+	int histograms;
+	int hist_bits;
+	int squares;
+};
+
+static struct trace_options trace;
+
+/*
+ * Comparison routines for qsort.
+ */
 
 static int
 sort_aq_spin(const void *l1_ptr, const void *l2_ptr)
@@ -135,9 +633,9 @@ sort_aq_spin(const void *l1_ptr, const void *l2_ptr)
         struct lock_info *l1 = (struct lock_info *) l1_ptr;
         struct lock_info *l2 = (struct lock_info *) l2_ptr;
 
-	if (l1->data[ACQ_DATA_TOTAL_TIME] < l2->data[ACQ_DATA_TOTAL_TIME])
+	if (l1->total[TIME_ACQ] < l2->total[TIME_ACQ])
 		return(1);
-	if (l1->data[ACQ_DATA_TOTAL_TIME] > l2->data[ACQ_DATA_TOTAL_TIME])
+	if (l1->total[TIME_ACQ] > l2->total[TIME_ACQ])
 		return(-1);
 	return(0);
 }
@@ -226,441 +724,4535 @@ sort_hold_total(const void *l1_ptr, const void *l2_ptr)
         struct lock_info *l1 = (struct lock_info *) l1_ptr;
         struct lock_info *l2 = (struct lock_info *) l2_ptr;
 
-	if (l1->data[HD_DATA_TOTAL_TIME] < l2->data[HD_DATA_TOTAL_TIME])
+	if (l1->total[TIME_HOLD] < l2->total[TIME_HOLD])
 		return(1);
-	if (l1->data[HD_DATA_TOTAL_TIME] > l2->data[HD_DATA_TOTAL_TIME])
+	if (l1->total[TIME_HOLD] > l2->total[TIME_HOLD])
 		return(-1);
 	return(0);
 }
 
 /*
- *  Simply remove the new line at the end of the stirng.
+ * Hash of a key (a stack of frame IDs, or the text of a frame), taken a word at a
+ * time (FNV-1a style multiply and fold, with a final mix of the high bits into the
+ * low bits used to index the table).
  */
-static void
-remove_new_line(char *buffer)
+static unsigned long
+hash_key(const char *key, size_t key_len)
 {
-	char *ptr;
+	unsigned long hash = 14695981039346656037UL ^ key_len;
+	unsigned long word;
 
-	ptr = strchr(buffer, '\n');
-	if (ptr) {
-		ptr[0] = ' ';
-		ptr[1] = '\0';
-	} else {
-		fprintf(stderr, "malformed line: %s\n", buffer);
-		exit(EXIT_FAILURE);
+	for (; key_len >= sizeof (word); key_len -= sizeof (word), key += sizeof (word)) {
+		memcpy(&word, key, sizeof (word));
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15UL;
+		hash ^= hash >> 32;
 	}
+	for (; key_len; key_len--, key++)
+		hash = (hash ^ (unsigned char) key[0]) * 1099511628211UL;
+	hash ^= hash >> 29;
+	return(hash);
 }
 
 /*
- * Read in the data from the bpftrace data file.  
- * fd: file reading from
- * index: index of the data field being read.
- * sdepth: how much of the stack to show.
- *
- *  Reads in the data from the file until '=' is seen as the first character.  When found,
- *  indicates that the section of this particular data is complete.
+ * Allocate size bytes from arena, moving on to the next block (allocating it if need
+ * be) when the current one does not have the room.
  */
-static void
-read_data(FILE *fd, int index, int sdepth)
+static void *
+arena_alloc(struct arena *arena, size_t size)
 {
-	char *ptr;
-	struct lock_info *data_ptr;
-	long value;
-	char buffer[1024];
-	char func_called[1024];
-	char stack_in[8192];
-	int depth = 0;
-	int need_add_stack = 0;
-	int have_function = 0;
+	struct arena_block *block = arena->current;
+	struct arena_block *new_block;
+	size_t block_size;
+	void *ptr;
 
-	for (;;) {
-		(void) fgets(buffer, 1024, fd);
-		/* Keep reading until end of section is hit */
-		if (buffer[0] == '=')
-			break;
-		/* Check to make sure it is not an empty piece of data */
-		if (strstr(buffer, "[]"))
-			continue;
-		/* Start of a new function stack? */
-		if (buffer[0] == '@') {
-			have_function = 0;
-			continue;
-		}
-		/* Grab the functon? */
-		remove_new_line(buffer);
-		if (have_function == 0) {
-			stack_in[0] = '\0';
-			strcpy(stack_in, buffer);
-			/* Line we have now, is mutex_lock */
-			(void) fgets(buffer, 1024, fd);
-			/* We now have the function */
-			have_function = 1;
-			remove_new_line(buffer);
-			ptr = strrchr(buffer, ' ');
-			ptr[0] = ':';
-			ptr[1] = '\0';
-			strcpy(func_called, buffer);
-			strcat(stack_in,buffer);
-			depth = 1;
-			continue;
-		}
-		/*
-		 * End of the stack, record the entry as well as the count of times.
-		 */
-		if (buffer[0] == ']') {
-			depth = 0;
-			/* end of data */
-			ptr  = strchr(buffer, ':');
-			if (ptr) {
-				value = atoll(&ptr[1]);
-			} else {
-				fprintf(stderr, "malformed line: %s\n", buffer);
-				exit(EXIT_FAILURE);
-			}
-			/*
-			 * Add the entry.
-			 */
-			if (number_lock_entries == 0) {
-				lock_data = data_ptr = (struct lock_info *) malloc(sizeof(struct lock_info));
-				number_lock_entries++;
-				need_add_stack = 1;
-			} else {
-				/*
-				 * We may have the stack already, go look for it.
-				 */
-				data_ptr = (struct lock_info *) bsearch(stack_in, lock_data, number_lock_entries,
-				    sizeof (struct lock_info), locate_stack);
-				if (data_ptr == NULL) {
-					/*
-					 * stack is not present, need to add the appropriate entry.
-					 */
-					need_add_stack = 1;
-					number_lock_entries++;
-					lock_data = (struct lock_info *) realloc(lock_data, sizeof (struct lock_info) * number_lock_entries);
-					data_ptr = &lock_data[number_lock_entries - 1];
-				}
-			}
-			if (need_add_stack) {
-				/*
-				 * Init the place saving the data and then set the fields accordingly.
-				 * Do not forget to qsort it if need be.
-				 */
-				need_add_stack = 0;
-				bzero(data_ptr, sizeof (struct lock_info));
-				data_ptr->stack = strdup(stack_in);
-				data_ptr->called_from = strdup(func_called);
-				data_ptr->data[index] = value;
-				qsort(lock_data, number_lock_entries, sizeof (struct lock_info), sort_stack);
-			} else
-				/*
-				 * Update the value.
-				 */
-				data_ptr->data[index] += value;
-			continue;
+	size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+	while (block && block->used + size > block->size) {
+		block = block->next;
+		if (block)
+			block->used = 0;
+	}
+	if (block == NULL) {
+		block_size = (size > ARENA_BLOCK) ? size : ARENA_BLOCK;
+		new_block = (struct arena_block *) malloc(sizeof (struct arena_block) + block_size);
+		if (new_block == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
 		}
-		/*
-		 * All we need to do is add the function to the stack.
-		 */
-		strcat(stack_in,buffer);
-		if (depth < sdepth) {
-			/*
-			 * keep adding to funcv_called, until the designated stack depth is reached.
-			 */
-			depth++;
-			ptr = strrchr(buffer, ' ');
-			ptr[0] = ':';
-			ptr[1] = '\0';
-			strcat(func_called, buffer);
+		new_block->size = block_size;
+		new_block->used = 0;
+		(void) __atomic_fetch_add(&arena_blocks, 1, __ATOMIC_RELAXED);
+		(void) __atomic_fetch_add(&arena_bytes, (long) block_size, __ATOMIC_RELAXED);
+		if (arena->current) {
+			new_block->next = arena->current->next;
+			arena->current->next = new_block;
+		} else {
+			new_block->next = NULL;
+			arena->first = new_block;
 		}
+		block = new_block;
 	}
+	arena->current = block;
+	ptr = (char *) (block + 1) + block->used;
+	block->used += size;
+	return(ptr);
 }
 
 /*
- * Walk through the various data areas of the bpftrace output file.
- * Note, any change in format of the output file, needs to be reflected
- * here.
+ * Throw away everything allocated from arena, keeping the blocks.
  */
 static void
-lookup_data(char *file, int sdepth)
+arena_reset(struct arena *arena)
 {
-	FILE *fd;
-	char buffer[1024];
+	arena->current = arena->first;
+	if (arena->first)
+		arena->first->used = 0;
+}
 
-	fd = fopen(file, "r");
-	if (fd == NULL) {
-		perror(file);
-		exit(EXIT_FAILURE);
-	}
+/*
+ * Give back the blocks of arena.
+ */
+static void
+arena_free(struct arena *arena)
+{
+	struct arena_block *block;
 
-	/*
-	 * First we have  aq data, skip the headers
-	 */
-	(void) fgets(buffer, 1024, fd);
-	(void) fgets(buffer, 1024, fd);
-
-	/* Now read the data in */
-	(void) fgets(buffer, 1024, fd);
-	(void) fgets(buffer, 1024, fd);
-	read_data(fd, ACQ_DATA_HOLD_AVG, sdepth);
-
-	(void) fgets(buffer, 1024, fd);
-	(void) fgets(buffer, 1024, fd);
-	read_data(fd, ACQ_DATA_HOLD_MAX, sdepth);
-
-	(void) fgets(buffer, 1024, fd);
-	(void) fgets(buffer, 1024, fd);
-	read_data(fd, ACQ_DATA_HOLD_COUNT, sdepth);
-
-	(void) fgets(buffer, 1024, fd);
-	(void) fgets(buffer, 1024, fd);
-	read_data(fd, HD_DATA_HOLD_AVG, sdepth);
-
-	(void) fgets(buffer, 1024, fd);
-	(void) fgets(buffer, 1024, fd);
-	read_data(fd, HD_DATA_HOLD_MAX, sdepth);
-
-	(void) fgets(buffer, 1024, fd);
-	(void) fgets(buffer, 1024, fd);
-	read_data(fd, HD_DATA_HOLD_COUNT, sdepth);
-	
-	(void) fclose(fd);
+	while ((block = arena->first) != NULL) {
+		arena->first = block->next;
+		free(block);
+	}
+	arena->current = NULL;
 }
 
 /*
- * Consdolidate the data based on matches with field called_from.
+ * Take over the blocks of from, with everything allocated from them, into to.  They
+ * go in front of those of to, so nothing more is allocated from them until to is
+ * reset.
  */
 static void
-organize_data()
+arena_adopt(struct arena *to, struct arena *from)
 {
-	struct lock_info *wptr;
-	struct lock_info *entry_add;
-	long new_average;
-	size_t count;
-	int add_entry;
+	struct arena_block *last;
 
-	qsort(lock_data, number_lock_entries, sizeof (struct lock_info), sort_func);
+	if (from->first == NULL)
+		return;
+	for (last = from->first; last->next; last = last->next)
+		;
+	last->next = to->first;
+	to->first = from->first;
+	if (to->current == NULL)
+		to->current = last;
+	from->first = from->current = NULL;
+}
 
-	for (count = 0; count < number_lock_entries; count++) {
-		add_entry = 0;
-		wptr = &lock_data[count];
-		if (count == 0) {
-			/* First entry */
-			cons_data = entry_add = (struct lock_info *) malloc(sizeof(struct lock_info));
-			add_entry = 1;
-		} else {
-			/* Look up entry */
-			entry_add = (struct lock_info *) bsearch(wptr->called_from, cons_data, number_cons_entries,
-			    sizeof (struct lock_info), locate_caller);
-			if (entry_add == NULL) {
-				/* New entry */
-				add_entry =  1;
-				number_cons_entries++;
-				cons_data = (struct lock_info *) realloc(cons_data, sizeof (struct lock_info)*number_cons_entries);
-				entry_add = &cons_data[number_cons_entries - 1];
-			}
+/*
+ * Add count to the [low, high) bucket of histogram which (TIME_ACQ or TIME_HOLD) of
+ * *hist, allocating the histogram if need be.  The buckets normally arrive in order,
+ * so the search is from the end.
+ */
+static void
+hist_add(struct lock_hist **hist, int which, long low, long high, long count)
+{
+	struct lock_hist *hptr = *hist;
+	size_t index;
+
+	if (hptr == NULL) {
+		hptr = *hist = (struct lock_hist *) calloc(1, sizeof (struct lock_hist));
+		if (hptr == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
 		}
-		if (add_entry) {
-			bzero(entry_add, sizeof (struct lock_info));
-			entry_add->called_from = wptr->called_from;
+	}
+	for (index = hptr->number[which]; index && hptr->buckets[which][index - 1].low > low; index--)
+		;
+	if (index && hptr->buckets[which][index - 1].low == low) {
+		hptr->buckets[which][index - 1].count += count;
+		return;
+	}
+	if (hptr->number[which] == hptr->size[which]) {
+		hptr->size[which] = hptr->size[which] ? hptr->size[which] * 2 : 16;
+		hptr->buckets[which] = (struct hist_bucket *) realloc(hptr->buckets[which],
+		    sizeof (struct hist_bucket) * hptr->size[which]);
+		if (hptr->buckets[which] == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
 		}
-		/* Now add things up. */
+	}
+	memmove(&hptr->buckets[which][index + 1], &hptr->buckets[which][index],
+	    sizeof (struct hist_bucket) * (hptr->number[which] - index));
+	hptr->buckets[which][index].low = low;
+	hptr->buckets[which][index].high = high;
+	hptr->buckets[which][index].count = count;
+	hptr->number[which]++;
+}
 
-		/* Adjust average */
-		new_average = entry_add->data[ACQ_DATA_HOLD_AVG]*entry_add->data[ACQ_DATA_HOLD_COUNT] +
-		    wptr->data[ACQ_DATA_HOLD_AVG]*wptr->data[ACQ_DATA_HOLD_COUNT];
-		entry_add->data[ACQ_DATA_HOLD_COUNT] += wptr->data[ACQ_DATA_HOLD_COUNT];
+/*
+ * Merge the histograms of from into *to.
+ */
+static void
+hist_merge(struct lock_hist **to, struct lock_hist *from)
+{
+	struct hist_bucket *bucket;
+	size_t index;
+	int which;
 
-		if (entry_add->data[ACQ_DATA_HOLD_COUNT])
-			entry_add->data[ACQ_DATA_HOLD_AVG] = new_average/entry_add->data[ACQ_DATA_HOLD_COUNT];
+	for (which = TIME_ACQ; which <= TIME_HOLD; which++) {
+		for (index = 0; index < from->number[which]; index++) {
+			bucket = &from->buckets[which][index];
+			hist_add(to, which, bucket->low, bucket->high, bucket->count);
+		}
+	}
+}
 
-		new_average = entry_add->data[HD_DATA_HOLD_AVG]*entry_add->data[HD_DATA_HOLD_COUNT] +
-		    wptr->data[HD_DATA_HOLD_AVG]*wptr->data[HD_DATA_HOLD_COUNT];
-		entry_add->data[HD_DATA_HOLD_COUNT] += wptr->data[HD_DATA_HOLD_COUNT];
+static void
+hist_free(struct lock_hist *hist)
+{
+	if (hist == NULL)
+		return;
+	free(hist->buckets[TIME_ACQ]);
+	free(hist->buckets[TIME_HOLD]);
+	free(hist);
+}
 
-		if (entry_add->data[HD_DATA_HOLD_COUNT])
-			entry_add->data[HD_DATA_HOLD_AVG] = new_average/entry_add->data[HD_DATA_HOLD_COUNT];
+/*
+ * Add the data of from into to, the counts and sums added, the maximums the larger of
+ * the two.  The averages are left to finish_data().
+ */
+static void
+add_data(struct lock_info *to, struct lock_info *from)
+{
+	to->data[ACQ_DATA_HOLD_COUNT] += from->data[ACQ_DATA_HOLD_COUNT];
+	to->data[HD_DATA_HOLD_COUNT] += from->data[HD_DATA_HOLD_COUNT];
+	to->total[TIME_ACQ] += from->total[TIME_ACQ];
+	to->total[TIME_HOLD] += from->total[TIME_HOLD];
+	to->squares[TIME_ACQ] += from->squares[TIME_ACQ];
+	to->squares[TIME_HOLD] += from->squares[TIME_HOLD];
+	to->error += from->error;
 
-		/* Now adjust the max hold if need be */
-		if (entry_add->data[ACQ_DATA_HOLD_MAX] < wptr->data[ACQ_DATA_HOLD_MAX])
-			entry_add->data[ACQ_DATA_HOLD_MAX] = wptr->data[ACQ_DATA_HOLD_MAX];
+	if (to->data[ACQ_DATA_HOLD_MAX] < from->data[ACQ_DATA_HOLD_MAX])
+		to->data[ACQ_DATA_HOLD_MAX] = from->data[ACQ_DATA_HOLD_MAX];
+	if (to->data[HD_DATA_HOLD_MAX] < from->data[HD_DATA_HOLD_MAX])
+		to->data[HD_DATA_HOLD_MAX] = from->data[HD_DATA_HOLD_MAX];
 
-		if (entry_add->data[HD_DATA_HOLD_MAX] < wptr->data[HD_DATA_HOLD_MAX])
-			entry_add->data[HD_DATA_HOLD_MAX] = wptr->data[HD_DATA_HOLD_MAX];
-	}
+	if (from->hist)
+		hist_merge(&to->hist, from->hist);
 }
 
 /*
- * Dump the lock information.
+ * Weight of lock_data entry index in the stack budget heap.
  */
+static lock_sum
+hh_weight(size_t index)
+{
+	return(lock_data[index].total[TIME_ACQ] + lock_data[index].error);
+}
+
 static void
-dump_data(char *output_file, char *caller, int sort_option, int numb_to_show)
+hh_swap(size_t pos1, size_t pos2)
 {
-	FILE *fd;
-	size_t count;
-	char *ptr, *ptr1, *ptr2;
-	char buffer[8192];
-	int stack_depth;
+	size_t index = hh_heap[pos1];
 
-	if (output_file) {
-		fd = fopen(output_file, "w");
-		if (fd == NULL) {
-			fd = stdout;
-			perror(output_file);
-			fprintf(stderr, "opening %s failed, falling back to stdout\n", output_file);
-		}
-	} else {
-		fd = stdout;
-	}
-	for (count = 0; count < number_cons_entries; count++) {
-		cons_data[count].data[ACQ_DATA_TOTAL_TIME] =
-		   cons_data[count].data[ACQ_DATA_HOLD_AVG] * cons_data[count].data[ACQ_DATA_HOLD_COUNT];
-		cons_data[count].data[HD_DATA_TOTAL_TIME] =
-		   cons_data[count].data[HD_DATA_HOLD_AVG] * cons_data[count].data[HD_DATA_HOLD_COUNT];
-	}
+	hh_heap[pos1] = hh_heap[pos2];
+	hh_heap[pos2] = index;
+	hh_position[hh_heap[pos1]] = pos1;
+	hh_position[hh_heap[pos2]] = pos2;
+}
 
-	switch (sort_option) {
-		case 0:
-			qsort(cons_data, number_cons_entries, sizeof (struct lock_info), sort_hold_count);
-		break;
-		case 1:
-			qsort(cons_data, number_cons_entries, sizeof (struct lock_info), sort_hold_max);
-		break;
-		case 2:
-			qsort(cons_data, number_cons_entries, sizeof (struct lock_info), sort_hold_avg);
-		break;
-		case 3:
-			qsort(cons_data, number_cons_entries, sizeof (struct lock_info), sort_hold_total);
-		break;
-		case 4:
-			qsort(cons_data, number_cons_entries, sizeof (struct lock_info), sort_aq_count);
-		break;
-		case 5:
-			qsort(cons_data, number_cons_entries, sizeof (struct lock_info), sort_aq_max);
-		break;
-		case 6:
-			qsort(cons_data, number_cons_entries, sizeof (struct lock_info), sort_aq_average);
-		break;
-		case 7:
-		default:
-			qsort(cons_data, number_cons_entries, sizeof (struct lock_info), sort_aq_spin);
-		break;
+/*
+ * Move the entry at pos of the budget heap down until neither child weighs less.
+ * The heap holds every lock_data entry, number_lock_entries of them.
+ */
+static void
+hh_sift_down(size_t pos)
+{
+	size_t child;
+
+	while ((child = pos * 2 + 1) < number_lock_entries) {
+		if (child + 1 < number_lock_entries && hh_weight(hh_heap[child + 1]) < hh_weight(hh_heap[child]))
+			child++;
+		if (hh_weight(hh_heap[pos]) <= hh_weight(hh_heap[child]))
+			break;
+		hh_swap(pos, child);
+		pos = child;
 	}
+}
 
-	fprintf(fd, "%48s%15s%15s%15s%15s%15s%15s\n",
-	   "caller", "# holds", "Hold Max (ns)", "Hold Avg (ns)", "# ACQs", "ACQs Max (ns)", "ACQs Avg (ns)");
-	if (numb_to_show < number_cons_entries)
-		number_cons_entries = numb_to_show;
-	for (count = 0;count < number_cons_entries; count++) {
-		stack_depth = 0;
-		if (cons_data[count].called_from != NULL) {
-			ptr = strchr(cons_data[count].called_from, ':');
-			if (ptr)
-				ptr[0] = '\0';
-			if (caller != NULL && stack_depth == 0) {
-				strcpy(buffer, cons_data[count].called_from);
-				ptr1 = buffer;
-				while(isspace(ptr1[0]))
-				       ptr1++;
-				ptr2 = strchr(ptr1, ' ');
-				if (ptr2)
-					ptr2[0] = '\0';
-				if (strcmp(ptr1, caller))
-					continue;
-			}
-			stack_depth++;
-			fprintf(fd, "%48s%15ld%15ld%15ld%15ld%15ld%15ld\n", cons_data[count].called_from, 
-			   cons_data[count].data[HD_DATA_HOLD_COUNT], cons_data[count].data[HD_DATA_HOLD_MAX],
-			      cons_data[count].data[HD_DATA_HOLD_AVG],
-			   cons_data[count].data[ACQ_DATA_HOLD_COUNT], cons_data[count].data[ACQ_DATA_HOLD_MAX],
-			      cons_data[count].data[ACQ_DATA_HOLD_AVG]);
-			if (ptr) {
-				ptr = &ptr[1];
-				while(ptr[0] != '\0') {
-					ptr1 = strchr(ptr, ':');
-					if(ptr1)
-						ptr1[0] = '\0';
-					fprintf(fd, "%48s\n", ptr);
-					ptr = ptr1;
-					if (ptr)
-						ptr++;
-				}
-			}
+/*
+ * Add the lock_data entry index, the last one added, to the budget heap.
+ */
+static void
+hh_insert(size_t index)
+{
+	size_t pos = index;
 
+	if (hh_heap == NULL) {
+		hh_heap = (size_t *) malloc(sizeof (size_t) * hh_budget);
+		hh_position = (size_t *) malloc(sizeof (size_t) * hh_budget);
+		hh_seen = (unsigned int *) malloc(sizeof (unsigned int) * hh_budget);
+		if (hh_heap == NULL || hh_position == NULL || hh_seen == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
 		}
 	}
+	hh_heap[pos] = index;
+	hh_position[index] = pos;
+	while (pos && hh_weight(hh_heap[pos]) < hh_weight(hh_heap[(pos - 1) / 2])) {
+		hh_swap(pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
 }
 
+/*
+ * A new capture or interval is being read, a stack new to it may have been folded
+ * before.
+ */
 static void
-usage(char *execname)
+hh_new_epoch()
 {
-	fprintf(stderr, "usage %s:\n", execname);
-	fprintf(stderr, "\t-C <func name> Just those stacks that the lock was called from this function\n");
-	fprintf(stderr, "\t-c <command> command to execute, if null, will reduce the data designated by -f\n");
-	fprintf(stderr, "\t-f <file name> name of data file to read from\n");
-	fprintf(stderr, "\t-h: help message\n");
-	fprintf(stderr, "\t-i <secs>: pull lock information every x seconds\n");
-	fprintf(stderr, "\t-n <#>: Number of locks to show.\n");
-	fprintf(stderr, "\t-o <file name>: output file\n");
-	fprintf(stderr, "\t-s <value> depth of stack to show\n");
-	fprintf(stderr, "\t-S <sort on>: recognized values\n");
-	fprintf(stderr, "\t\t0: # holds\n");
-	fprintf(stderr, "\t\t1: Hold Max\n");
-	fprintf(stderr, "\t\t2: Hold Avg\n");
-	fprintf(stderr, "\t\t3: Hold total\n");
-	fprintf(stderr, "\t\t4: # ACQs\n");
-	fprintf(stderr, "\t\t5: # ACQs Max\n");
-	fprintf(stderr, "\t\t6: # ACQs average\n");
-	fprintf(stderr, "\t\t7: # ACQs total time (AVG * count), default\n");
-	exit(EXIT_SUCCESS);
+	hh_prior_error = hh_fold_max;
+	hh_epoch++;
 }
 
 /*
- * Generate the required bpftrace script.
+ * The acquire time of entry has gone up, restore the budget heap.
  */
 static void
-bpftrace_create(int interval)
+hh_update(struct lock_info *entry)
 {
+	if (hh_budget && entry != &other_data)
+		hh_sift_down(hh_position[entry - lock_data]);
+}
+
+/*
+ * Take lock_data entry index out of the stack hash table.  The entries following it
+ * in its run are shifted back, so that every entry can still be reached by probing
+ * from its home slot.
+ */
+static void
+remove_stack(size_t index)
+{
+	size_t mask = stack_table_size - 1;
+	size_t slot;
+	size_t next;
+	size_t home;
+
+	for (slot = lock_data[index].hash & mask; stack_table[slot] != index + 1; slot = (slot + 1) & mask)
+		;
+	for (next = (slot + 1) & mask; stack_table[next]; next = (next + 1) & mask) {
+		home = lock_data[stack_table[next] - 1].hash & mask;
+		if (((next - home) & mask) >= ((next - slot) & mask)) {
+			stack_table[slot] = stack_table[next];
+			slot = next;
+		}
+	}
+	stack_table[slot] = 0;
+}
+
+/*
+ * A stack of weight acquire time, on top of what it may have had folded before, was
+ * not kept, raise the bound on what a stack not kept may have in other_data.
+ */
+static void
+fold_stack(lock_sum weight)
+{
+	if (hh_fold_max < weight)
+		hh_fold_max = weight;
+	hh_folded++;
+}
+
+/*
+ * The stack budget is used up, fold the entry of least weight into other_data and
+ * hand it back, cleared, with the error of a stack new to this capture or interval.
+ * If the entry is yet to be seen in it, a stack new to it may now be that one.
+ */
+static struct lock_info *
+evict_stack()
+{
+	struct lock_info *data_ptr = &lock_data[hh_heap[0]];
+	lock_sum weight = hh_weight(hh_heap[0]);
+
+	fold_stack(weight);
+	if (hh_seen[hh_heap[0]] != hh_epoch && hh_prior_error < weight)
+		hh_prior_error = weight;
+	remove_stack(hh_heap[0]);
+	/* other_data is exact, it has no error of its own */
+	data_ptr->error = 0;
+	add_data(&other_data, data_ptr);
+	free(data_ptr->frames);
+	hist_free(data_ptr->hist);
+	bzero(data_ptr, sizeof (struct lock_info));
+	data_ptr->error = hh_prior_error;
+	return(data_ptr);
+}
+
+/*
+ * Double the size of the stack hash table (or more, until it is under half full), and
+ * reinsert every entry in lock_data.
+ */
+static void
+grow_stack_table()
+{
+	size_t count;
+	size_t slot;
+	size_t mask;
+
+	free(stack_table);
+	do {
+		if (stack_table_size == 0)
+			stack_table_size = STACK_TABLE_MIN;
+		else
+			stack_table_size *= 2;
+	} while (number_lock_entries * 2 >= stack_table_size);
+	stack_table = (size_t *) calloc(stack_table_size, sizeof (size_t));
+	if (stack_table == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	mask = stack_table_size - 1;
+	for (count = 0; count < number_lock_entries; count++) {
+		slot = lock_data[count].hash & mask;
+		while (stack_table[slot])
+			slot = (slot + 1) & mask;
+		stack_table[slot] = count + 1;
+	}
+}
+
+/*
+ * Locate the entry for the designated stack of frame IDs, lock and run, adding a new
+ * (zeroed) entry if they have not been seen before.  The stack of a new entry is
+ * a copy of the one passed in.  Once the stack budget (-m) is used up, a new stack
+ * bringing weight acquire time takes over the entry of the lightest stack if it
+ * weighs more, otherwise (or if weight is negative) NULL is returned and the data
+ * belongs in other_data.
+ */
+static struct lock_info *
+lookup_stack(const unsigned int *frames, size_t number_frames, unsigned long lock, unsigned int run,
+    lock_sum weight)
+{
+	struct lock_info *data_ptr;
+	unsigned long hash;
+	size_t stack_len = number_frames * sizeof (unsigned int);
+	size_t slot;
+	size_t mask;
+
+	if (number_lock_entries * 2 >= stack_table_size)
+		grow_stack_table();
+
+	hash = hash_key((const char *) frames, stack_len) ^ (lock * 0x9e3779b97f4a7c15UL) ^
+	    (run * 0xc2b2ae3d27d4eb4fUL);
+	mask = stack_table_size - 1;
+	for (slot = hash & mask; stack_table[slot]; slot = (slot + 1) & mask) {
+		data_ptr = &lock_data[stack_table[slot] - 1];
+		if (data_ptr->hash == hash && data_ptr->number_frames == number_frames &&
+		    data_ptr->lock == lock && data_ptr->run == run &&
+		    memcmp(data_ptr->frames, frames, stack_len) == 0) {
+			if (hh_budget && weight >= 0)
+				hh_seen[data_ptr - lock_data] = hh_epoch;
+			return(data_ptr);
+		}
+	}
+
+	/*
+	 * stack is not present, need to add the appropriate entry.
+	 */
+	if (hh_budget && number_lock_entries == hh_budget) {
+		if (weight < 0)
+			return(NULL);
+		if (weight <= hh_weight(hh_heap[0])) {
+			fold_stack(weight + hh_prior_error);
+			return(NULL);
+		}
+		data_ptr = evict_stack();
+		/* The slot found may have moved up with the removal */
+		for (slot = hash & mask; stack_table[slot]; slot = (slot + 1) & mask)
+			;
+	} else {
+		if (number_lock_entries == lock_data_size) {
+			lock_data_size = lock_data_size ? lock_data_size * 2 : STACK_TABLE_MIN;
+			lock_data = (struct lock_info *) realloc(lock_data,
+			    sizeof (struct lock_info) * lock_data_size);
+			if (lock_data == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		data_ptr = &lock_data[number_lock_entries++];
+		bzero(data_ptr, sizeof (struct lock_info));
+		if (hh_budget) {
+			data_ptr->error = hh_prior_error;
+			hh_insert(number_lock_entries - 1);
+		}
+	}
+	if (hh_budget) {
+		hh_seen[data_ptr - lock_data] = hh_epoch;
+		data_ptr->frames = (unsigned int *) malloc(stack_len);
+		if (data_ptr->frames == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	} else
+		data_ptr->frames = (unsigned int *) arena_alloc(&stack_arena, stack_len);
+	memcpy(data_ptr->frames, frames, stack_len);
+	data_ptr->number_frames = number_frames;
+	data_ptr->lock = lock;
+	data_ptr->run = run;
+	data_ptr->hash = hash;
+	stack_table[slot] = data_ptr - lock_data + 1;
+	return(data_ptr);
+}
+
+/*
+ * Double the size of the frame hash table, and reinsert every entry in frame_data.
+ */
+static void
+grow_frame_table()
+{
+	size_t count;
+	size_t slot;
+	size_t mask;
+
+	free(frame_table);
+	if (frame_table_size == 0)
+		frame_table_size = STACK_TABLE_MIN;
+	else
+		frame_table_size *= 2;
+	frame_table = (size_t *) calloc(frame_table_size, sizeof (size_t));
+	if (frame_table == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	mask = frame_table_size - 1;
+	for (count = 0; count < number_frame_entries; count++) {
+		slot = frame_data[count].hash & mask;
+		while (frame_table[slot])
+			slot = (slot + 1) & mask;
+		frame_table[slot] = count + 1;
+	}
+}
+
+/*
+ * Return the ID of the frame named name (length bytes, not terminated), adding it
+ * if it has not been seen before.
+ */
+static unsigned int
+intern_frame(const char *name, size_t length)
+{
+	struct frame_info *frame;
+	unsigned long hash;
+	size_t slot;
+	size_t mask;
+
+	if (number_frame_entries * 2 >= frame_table_size)
+		grow_frame_table();
+
+	hash = hash_key(name, length);
+	mask = frame_table_size - 1;
+	for (slot = hash & mask; frame_table[slot]; slot = (slot + 1) & mask) {
+		frame = &frame_data[frame_table[slot] - 1];
+		if (frame->hash == hash && frame->length == length &&
+		    memcmp(frame->name, name, length) == 0)
+			return(frame_table[slot] - 1);
+	}
+
+	if (number_frame_entries == frame_data_size) {
+		frame_data_size = frame_data_size ? frame_data_size * 2 : STACK_TABLE_MIN;
+		frame_data = (struct frame_info *) realloc(frame_data,
+		    sizeof (struct frame_info) * frame_data_size);
+		if (frame_data == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	frame = &frame_data[number_frame_entries];
+	frame->name = (char *) arena_alloc(&name_arena, length + 1);
+	memcpy(frame->name, name, length);
+	frame->name[length] = '\0';
+	frame->length = length;
+	frame->hash = hash;
+	frame->lock_frame = (strncmp(frame->name, "mutex_", 6) == 0 ||
+	    strncmp(frame->name, "__mutex_", 8) == 0);
+	number_frame_entries++;
+	frame_table[slot] = number_frame_entries;
+	return(number_frame_entries - 1);
+}
+
+/*
+ * Parse the decimal number at ptr (after any white space), stopping at end.
+ */
+static long
+parse_number(const char *ptr, const char *end)
+{
+	long value = 0;
+	int negative = 0;
+
+	for (; ptr < end && isspace((unsigned char) ptr[0]); ptr++)
+		;
+	if (ptr < end && ptr[0] == '-') {
+		negative = 1;
+		ptr++;
+	}
+	for (; ptr < end && isdigit((unsigned char) ptr[0]); ptr++)
+		value = value * 10 + (ptr[0] - '0');
+	return(negative ? -value : value);
+}
+
+/*
+ * Locate the ':' of the line ending a stack, the line runs from line to end.
+ */
+static const char *
+find_value(const char *line, const char *end)
+{
+	const char *ptr;
+
+	ptr = memchr(line, ':', end - line);
+	if (ptr == NULL) {
+		fprintf(stderr, "malformed line: %.*s\n", (int) (end - line), line);
+		exit(EXIT_FAILURE);
+	}
+	return(ptr + 1);
+}
+
+/*
+ * Parse the value of a stats() map, the line ending a stack looks like:
+ *     ]: count 12, average 345, total 4140
+ * The count and total are multiplied by scale, to estimate them from sampled data.
+ * The printed average is ignored, it is worked out from the exact total once all the
+ * data is added up (the stack may be seen again, in a later interval in the same file).
+ */
+static void
+parse_stats(const char *line, const char *end, long *count, lock_sum *total, long scale)
+{
+	const char *ptr;
+
+	for (ptr = find_value(line, end); ptr < end; ptr++) {
+		if (end - ptr > 6 && strncmp(ptr, "count ", 6) == 0)
+			*count += parse_number(ptr + 6, end) * scale;
+		else if (end - ptr > 6 && strncmp(ptr, "total ", 6) == 0)
+			*total += (lock_sum) parse_number(ptr + 6, end) * scale;
+	}
+}
+
+/*
+ * Parse the value of one of the sum of squares maps (-d), index being the section.  The
+ * squares are summed by bpftrace in two halves, the high 32 bits and the low 32 bits of
+ * each square, so neither sum overflows.
+ */
+static void
+parse_squares(struct lock_info *entry, int index, const char *line, const char *end)
+{
+	lock_sum value = (lock_sum) parse_number(find_value(line, end), end) * sample_rate;
+	int which = (index == SECTION_AQ_SQ_HIGH || index == SECTION_AQ_SQ_LOW) ? TIME_ACQ : TIME_HOLD;
+
+	if (index == SECTION_AQ_SQ_HIGH || index == SECTION_HD_SQ_HIGH)
+		value <<= 32;
+	entry->squares[which] += value;
+}
+
+static long
+sum_to_long(lock_sum sum)
+{
+	if (sum > LONG_MAX)
+		return(LONG_MAX);
+	if (sum < LONG_MIN)
+		return(LONG_MIN);
+	return((long) sum);
+}
+
+/*
+ * Work out the averages and totals of data from the exact sums of the times, once all
+ * the data is added up.  With squares and stddev, the standard deviations as well.
+ */
+static void
+finish_data(long *data, const lock_sum *total, const lock_sum *squares, long *stddev)
+{
+	long double mean;
+	long double variance;
+	long count;
+	int which;
+
+	for (which = TIME_ACQ; which <= TIME_HOLD; which++) {
+		count = data[DATA_INDEX(which, ACQ_DATA_HOLD_COUNT)];
+		data[DATA_INDEX(which, ACQ_DATA_TOTAL_TIME)] = sum_to_long(total[which]);
+		data[DATA_INDEX(which, ACQ_DATA_HOLD_AVG)] = count ? sum_to_long(total[which] / count) : 0;
+		if (stddev == NULL)
+			continue;
+		stddev[which] = 0;
+		if (count && squares[which]) {
+			mean = (long double) total[which] / count;
+			variance = (long double) squares[which] / count - mean * mean;
+			if (variance > 0)
+				stddev[which] = (long) (sqrtl(variance) + 0.5);
+		}
+	}
+}
+
+/*
+ * Parse a histogram bucket bound, a number with an optional fraction and an optional
+ * K, M, G, T, P or E suffix (powers of 1024), as bpftrace prints them.  *ptr is left
+ * after it.
+ */
+static long
+parse_size(const char **ptr, const char *end)
+{
+	const char *cp = *ptr;
+	const char *suffixes = "KMGTPE";
+	const char *suffix;
+	double value = 0;
+	double scale = 0.1;
+
+	for (; cp < end && isspace((unsigned char) cp[0]); cp++)
+		;
+	for (; cp < end && isdigit((unsigned char) cp[0]); cp++)
+		value = value * 10 + (cp[0] - '0');
+	if (cp < end && cp[0] == '.') {
+		for (cp++; cp < end && isdigit((unsigned char) cp[0]); cp++, scale /= 10)
+			value += (cp[0] - '0') * scale;
+	}
+	if (cp < end && cp[0] && (suffix = strchr(suffixes, cp[0])) != NULL) {
+		for (; suffix >= suffixes; suffix--)
+			value *= 1024;
+		cp++;
+	}
+	*ptr = cp;
+	return((long) (value + 0.5));
+}
+
+/*
+ * Work out the percentiles of the histograms, interpolating linearly within the
+ * bucket the percentile falls in.
+ */
+static void
+hist_percentiles(struct lock_hist *hist)
+{
+	struct hist_bucket *bucket;
+	double total;
+	double target;
+	double cumulative;
+	size_t index;
+	int which;
+	int pct;
+
+	for (which = TIME_ACQ; which <= TIME_HOLD; which++) {
+		total = 0;
+		for (index = 0; index < hist->number[which]; index++)
+			total += hist->buckets[which][index].count;
+		for (pct = 0; pct < NUMBER_PERCENTILES; pct++) {
+			hist->percentiles[which][pct] = 0;
+			if (total == 0)
+				continue;
+			target = total * percentile_values[pct];
+			cumulative = 0;
+			for (index = 0; index < hist->number[which]; index++) {
+				bucket = &hist->buckets[which][index];
+				if (bucket->count && cumulative + bucket->count >= target)
+					break;
+				cumulative += bucket->count;
+			}
+			if (index == hist->number[which])
+				index--;
+			bucket = &hist->buckets[which][index];
+			hist->percentiles[which][pct] = bucket->low + (long) ((bucket->high - bucket->low) *
+			    ((target - cumulative) / (bucket->count ? bucket->count : 1)));
+		}
+	}
+}
+
+/*
+ * Parse a histogram bucket line of the stack just read, [low, high) or [value] followed
+ * by the count.  The count is scaled up the same as the stats are.
+ */
+static void
+parse_bucket(struct lock_info *entry, int which, const char *line, const char *end)
+{
+	const char *ptr = line + 1;
+	long low;
+	long high;
+
+	low = parse_size(&ptr, end);
+	if (ptr < end && ptr[0] == ',') {
+		ptr++;
+		high = parse_size(&ptr, end);
+	} else
+		high = low + 1;
+	for (; ptr < end && ptr[0] != ')' && ptr[0] != ']'; ptr++)
+		;
+	if (ptr == end)
+		return;
+	hist_add(&entry->hist, which, low, high, parse_number(ptr + 1, end) * sample_rate);
+}
+
+static int
+sort_ksym(const void *k1_ptr, const void *k2_ptr)
+{
+	struct ksym *k1 = (struct ksym *) k1_ptr;
+	struct ksym *k2 = (struct ksym *) k2_ptr;
+
+	if (k1->address < k2->address)
+		return(-1);
+	if (k1->address > k2->address)
+		return(1);
+	return(0);
+}
+
+/*
+ * Add a symbol to the table syms, of *number entries with *size allocated.
+ */
+static void
+add_ksym(struct ksym **syms, size_t *number, size_t *size, unsigned long address, char *name)
+{
+	if (*number == *size) {
+		*size = *size ? *size * 2 : 65536;
+		*syms = (struct ksym *) realloc(*syms, sizeof (struct ksym) * *size);
+		if (*syms == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	(*syms)[*number].address = address;
+	(*syms)[*number].name = (char *) arena_alloc(&symbol_arena, strlen(name) + 1);
+	strcpy((*syms)[*number].name, name);
+	(*number)++;
+}
+
+/*
+ * Read in the kernel text and data symbols from kallsyms_file, and sort them by
+ * address.  Called through pthread_once(), on ksyms_once.
+ */
+static void
+load_kallsyms()
+{
+	FILE *fd;
+	char buffer[1024];
+	char type;
+	char name[512];
+	unsigned long address;
+	size_t ksyms_size = 0;
+	size_t dsyms_size = 0;
+
+	fd = fopen(kallsyms_file, "r");
+	if (fd == NULL) {
+		perror(kallsyms_file);
+		fprintf(stderr, "raw stacks and locks will be shown as addresses\n");
+		return;
+	}
+	while (fgets(buffer, sizeof (buffer), fd)) {
+		if (sscanf(buffer, "%lx %c %511s", &address, &type, name) != 3)
+			continue;
+		if (type == 't' || type == 'T' || type == 'w' || type == 'W')
+			add_ksym(&ksyms, &number_ksyms, &ksyms_size, address, name);
+		else if (strchr("dDbBrR", type))
+			add_ksym(&dsyms, &number_dsyms, &dsyms_size, address, name);
+	}
+	(void) fclose(fd);
+	qsort(ksyms, number_ksyms, sizeof (struct ksym), sort_ksym);
+	qsort(dsyms, number_dsyms, sizeof (struct ksym), sort_ksym);
+	if (number_ksyms && ksyms[number_ksyms - 1].address == 0)
+		fprintf(stderr, "%s shows no addresses (not root?), raw stacks and locks will be shown as addresses\n",
+		    kallsyms_file);
+}
+
+/*
+ * Binary search syms for the symbol holding address, NULL if there is none.
+ */
+static struct ksym *
+find_ksym(struct ksym *syms, size_t number, unsigned long address)
+{
+	size_t low = 0;
+	size_t high = number;
+	size_t middle;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		if (syms[middle].address <= address)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (low == 0 || syms[low - 1].address == 0)
+		return(NULL);
+	return(&syms[low - 1]);
+}
+
+/*
+ * Look up the symbol for address, and format it the way bpftrace does
+ * (symbol+offset), returning the ID of the frame.
+ */
+static unsigned int
+symbolize_address(unsigned long address)
+{
+	struct ksym *sym;
+	char buffer[600];
+	int length;
+
+	sym = find_ksym(ksyms, number_ksyms, address);
+	if (sym == NULL)
+		length = snprintf(buffer, sizeof (buffer), "0x%lx", address);
+	else
+		length = snprintf(buffer, sizeof (buffer), "%s+%lu", sym->name, address - sym->address);
+	if (length >= (int) sizeof (buffer))
+		length = sizeof (buffer) - 1;
+	return(intern_frame(buffer, length));
+}
+
+/*
+ * Resolve an address of a raw stack to its frame, each address is only looked up
+ * once.
+ */
+static unsigned int
+resolve_address(unsigned long address)
+{
+	struct address_entry *old_table;
+	size_t old_size;
+	size_t count;
+	size_t slot;
+	size_t mask;
+
+	(void) pthread_once(&ksyms_once, load_kallsyms);
+	if (number_addresses * 2 >= address_table_size) {
+		old_table = address_table;
+		old_size = address_table_size;
+		address_table_size = old_size ? old_size * 2 : STACK_TABLE_MIN;
+		address_table = (struct address_entry *) calloc(address_table_size,
+		    sizeof (struct address_entry));
+		if (address_table == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		mask = address_table_size - 1;
+		for (count = 0; count < old_size; count++) {
+			if (old_table[count].frame == 0)
+				continue;
+			slot = (old_table[count].address * 0x9e3779b97f4a7c15UL >> 20) & mask;
+			while (address_table[slot].frame)
+				slot = (slot + 1) & mask;
+			address_table[slot] = old_table[count];
+		}
+		free(old_table);
+	}
+	mask = address_table_size - 1;
+	for (slot = (address * 0x9e3779b97f4a7c15UL >> 20) & mask; address_table[slot].frame;
+	    slot = (slot + 1) & mask) {
+		if (address_table[slot].address == address)
+			return(address_table[slot].frame - 1);
+	}
+	address_table[slot].address = address;
+	address_table[slot].frame = symbolize_address(address) + 1;
+	number_addresses++;
+	return(address_table[slot].frame - 1);
+}
+
+/*
+ * Parse a raw stack frame, hex digits with an optional leading 0x.  Returns 0 if
+ * the frame is not an address (a symbolized frame).
+ */
+static int
+parse_address(const char *ptr, size_t length, unsigned long *address)
+{
+	unsigned long value = 0;
+	size_t count;
+	int digit;
+
+	if (length > 2 && ptr[0] == '0' && (ptr[1] == 'x' || ptr[1] == 'X')) {
+		ptr += 2;
+		length -= 2;
+	}
+	if (length == 0 || length > 2 * sizeof (unsigned long))
+		return(0);
+	for (count = 0; count < length; count++) {
+		digit = ptr[count];
+		if (digit >= '0' && digit <= '9')
+			digit -= '0';
+		else if ((digit | 0x20) >= 'a' && (digit | 0x20) <= 'f')
+			digit = (digit | 0x20) - 'a' + 10;
+		else
+			return(0);
+		value = (value << 4) | digit;
+	}
+	*address = value;
+	return(1);
+}
+
+/*
+ * Build the called_from string of a consolidated entry, the number_frames frames
+ * separated (and terminated) by ':', in arena.
+ */
+static char *
+build_called_from(struct arena *arena, const unsigned int *frames, size_t number_frames)
+{
+	struct frame_info *frame;
+	size_t length = 1;
+	size_t count;
+	char *called_from;
+	char *ptr;
+
+	for (count = 0; count < number_frames; count++)
+		length += frame_data[frames[count]].length + 1;
+	ptr = called_from = (char *) arena_alloc(arena, length);
+	for (count = 0; count < number_frames; count++) {
+		frame = &frame_data[frames[count]];
+		memcpy(ptr, frame->name, frame->length);
+		ptr += frame->length;
+		*ptr++ = ':';
+	}
+	*ptr = '\0';
+	return(called_from);
+}
+
+/*
+ * Index of the frame of the stack being parsed for the mutex function that was called.
+ * The kprobe stacks start there, the stacks from the contention tracepoint start down
+ * in the slow path (__mutex_lock, __mutex_lock_slowpath, then mutex_lock).  The frames
+ * before are dropped, so the stacks of both start with the mutex function called.
+ */
+static size_t
+stack_start(struct parse_state *ps)
+{
+	size_t count;
+
+	for (count = 0; count < ps->number_frames && count < LOCK_FRAMES_MAX; count++) {
+		if (frame_data[ps->frames[count]].lock_frame)
+			break;
+	}
+	if (count == ps->number_frames || count == LOCK_FRAMES_MAX)
+		return(0);
+	while (count + 1 < ps->number_frames && frame_data[ps->frames[count + 1]].lock_frame)
+		count++;
+	return(count);
+}
+
+/*
+ * Parse the lock address of an @map[lock, stack] key, printed in decimal by bpftrace
+ * (hex with a leading 0x is taken as well).  Returns 0 if there is none.
+ */
+static unsigned long
+parse_lock(const char *ptr, const char *end)
+{
+	unsigned long lock = 0;
+	const char *last;
+
+	for (; ptr < end && isspace((unsigned char) ptr[0]); ptr++)
+		;
+	for (last = ptr; last < end && isalnum((unsigned char) last[0]); last++)
+		;
+	if (last - ptr > 2 && ptr[0] == '0' && (ptr[1] == 'x' || ptr[1] == 'X')) {
+		if (!parse_address(ptr, last - ptr, &lock))
+			return(0);
+		return(lock);
+	}
+	for (; ptr < last && isdigit((unsigned char) ptr[0]); ptr++)
+		lock = lock * 10 + (ptr[0] - '0');
+	return(lock);
+}
+
+/*
+ * Look up the section title, returning the data field the section fills in.
+ */
+static int
+section_index(const char *title, size_t length)
+{
+	int count;
+
+	while (length && isspace((unsigned char) title[length - 1]))
+		length--;
+	for (count = 0; sections[count].title; count++) {
+		if (strlen(sections[count].title) == length &&
+		    strncmp(sections[count].title, title, length) == 0)
+			return(sections[count].index);
+	}
+	return(-1);
+}
+
+/*
+ * Time now on clock, in ns.
+ */
+static long
+clock_ns(clockid_t clock)
+{
+	struct timespec now;
+
+	(void) clock_gettime(clock, &now);
+	return(now.tv_sec * 1000000000L + now.tv_nsec);
+}
+
+/*
+ * Move on to phase (-1 for none), charging the one left with the time since it was
+ * entered.  Returns the phase left, to go back to.
+ */
+static int
+phase_begin(int phase)
+{
+	double wall = (double) clock_ns(CLOCK_MONOTONIC) / 1e9;
+	double cpu = (double) clock_ns(CLOCK_PROCESS_CPUTIME_ID) / 1e9;
+	int previous = current_phase;
+
+	if (current_phase >= 0) {
+		phase_stats[current_phase].wall += wall - phase_wall;
+		phase_stats[current_phase].cpu += cpu - phase_cpu;
+	}
+	phase_wall = wall;
+	phase_cpu = cpu;
+	current_phase = phase;
+	return(previous);
+}
+
+/*
+ * Start charging a section from from, now.
+ */
+static void
+section_start(struct section_mark *mark, const char *from)
+{
+	mark->from = from;
+	mark->lines = 0;
+	mark->wall_ns = clock_ns(CLOCK_MONOTONIC);
+	mark->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/*
+ * Charge section index with what was parsed since mark, up to upto, and start again
+ * from there.
+ */
+static void
+section_charge(struct section_mark *mark, int index, const char *upto)
+{
+	struct section_stats *stats = &section_stats[SECTION_SLOT(index)];
+	long wall_ns = clock_ns(CLOCK_MONOTONIC);
+	long cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	(void) __atomic_fetch_add(&stats->lines, mark->lines, __ATOMIC_RELAXED);
+	(void) __atomic_fetch_add(&stats->bytes, (long) (upto - mark->from), __ATOMIC_RELAXED);
+	(void) __atomic_fetch_add(&stats->wall_ns, wall_ns - mark->wall_ns, __ATOMIC_RELAXED);
+	(void) __atomic_fetch_add(&stats->cpu_ns, cpu_ns - mark->cpu_ns, __ATOMIC_RELAXED);
+	mark->from = upto;
+	mark->lines = 0;
+	mark->wall_ns = wall_ns;
+	mark->cpu_ns = cpu_ns;
+}
+
+/*
+ * Parse the bpftrace output held in buf, len bytes long.  Records the data of every
+ * complete stack into lock_data.
+ *
+ * The data is made up of sections, each started with a title surrounded by lines of
+ * '='.  Each section holds the entries of a bpftrace map keyed by stack:
+ *     @map[
+ *         mutex_lock+5
+ *         caller+39
+ *         ...
+ *     ]: value
+ * Each frame is turned into its frame ID as it is read, the stack being kept as the
+ * array of IDs.  With kstack(raw), the frames are addresses which are resolved here.
+ *
+ * Returns the number of bytes consumed, which is everything unless final is not set,
+ * in which case parsing stops at the start of the first incomplete line or stack.
+ */
+static size_t
+parse_buffer(struct parse_state *ps, const char *buf, size_t len, int final)
+{
+	const char *end = buf + len;
+	const char *line;
+	const char *eol;
+	const char *next;
+	const char *record = NULL;
+	const char *ptr;
+	const char *last;
+	struct lock_info *data_ptr;
+	struct section_mark mark;
+	unsigned long address;
+	size_t start;
+	long record_lines = 0;
+	long value;
+	long count;
+	lock_sum total;
+	int which;
+
+	ps->base = buf;
+	section_start(&mark, buf);
+	for (line = buf; line < end; line = next) {
+		eol = memchr(line, '\n', end - line);
+		if (eol == NULL) {
+			if (!final)
+				break;
+			eol = end;
+			next = end;
+		} else
+			next = eol + 1;
+		mark.lines++;
+
+		/* Section headers, a title between two lines of '=' */
+		if (line[0] == '=') {
+			ps->hist_entry = NULL;
+			ps->title_state = (ps->title_state == TITLE_NEXT) ? TITLE_NONE : TITLE_EXPECTED;
+			record = NULL;
+			continue;
+		}
+		if (ps->title_state == TITLE_EXPECTED) {
+			section_charge(&mark, ps->index, line);
+			ps->index = section_index(line, eol - line);
+			ps->title_state = TITLE_NEXT;
+			if (ps->index == SECTION_AQ_HIST || ps->index == SECTION_HD_HIST)
+				hist_data = 1;
+			else if (ps->index <= SECTION_AQ_SQ_HIGH)
+				squares_data = 1;
+			/* Averages cannot be folded together, old data is kept whole */
+			if (hh_budget && (ps->index == ACQ_DATA_HOLD_AVG || ps->index == HD_DATA_HOLD_AVG)) {
+				fprintf(stderr, "Data has no stats sections, the stack budget (-m) is ignored\n");
+				hh_budget = 0;
+			}
+			if (ps->index == SECTION_AQ_STATS)
+				hh_new_epoch();
+			if (ps->index == SECTION_END && ps->end_of_data) {
+				/* The report is not parsing */
+				section_charge(&mark, ps->index, next);
+				ps->end_of_data();
+				section_start(&mark, next);
+			}
+			continue;
+		}
+		ps->title_state = TITLE_NONE;
+
+		/* bpftrace is up and tracing */
+		if ((size_t) (eol - line) == sizeof (READY_LINE) - 1 &&
+		    strncmp(line, READY_LINE, eol - line) == 0) {
+			ps->ready = 1;
+			continue;
+		}
+
+		/* How the data was sampled, "rate N threshold X" */
+		if (ps->index == SECTION_SAMPLING) {
+			for (ptr = line; ptr < eol; ptr++) {
+				if (eol - ptr > 5 && strncmp(ptr, "rate ", 5) == 0)
+					sample_rate = parse_number(ptr + 5, eol);
+				else if (eol - ptr > 10 && strncmp(ptr, "threshold ", 10) == 0)
+					sample_threshold = parse_number(ptr + 10, eol);
+			}
+			if (sample_rate < 1)
+				sample_rate = 1;
+			continue;
+		}
+		/* The unkeyed stats() of every acquisition or hold, @aq_all: count ... */
+		if (ps->index == SECTION_AQ_ALL || ps->index == SECTION_HD_ALL) {
+			if (line[0] == '@' && ps->index == SECTION_AQ_ALL)
+				parse_stats(line, eol, &totals[ACQ_DATA_HOLD_COUNT], &total_times[TIME_ACQ], 1);
+			else if (line[0] == '@')
+				parse_stats(line, eol, &totals[HD_DATA_HOLD_COUNT], &total_times[TIME_HOLD], 1);
+			continue;
+		}
+
+		/* Start of a new function stack? */
+		if (line[0] == '@') {
+			ps->hist_entry = NULL;
+			/* Check to make sure it is not an empty piece of data */
+			if (memchr(line, ']', eol - line))
+				continue;
+			record = line;
+			record_lines = mark.lines - 1;
+			ps->number_frames = 0;
+			/* Keyed by lock as well, @map[lock, stack] */
+			ptr = memchr(line, '[', eol - line);
+			ps->lock = ptr ? parse_lock(ptr + 1, eol) : 0;
+			continue;
+		}
+		/* A bucket of the histogram of the stack just ended */
+		if (ps->hist_entry && line[0] == '[') {
+			parse_bucket(ps->hist_entry,
+			    ps->index == SECTION_AQ_HIST ? TIME_ACQ : TIME_HOLD, line, eol);
+			continue;
+		}
+		if (record == NULL || ps->index == -1 || ps->index == SECTION_END)
+			continue;
+		/*
+		 * End of the stack, record the entry as well as the value.
+		 */
+		if (line[0] == ']') {
+			start = stack_start(ps);
+			if (ps->number_frames - start >= 2) {
+				/* Only the acquire times decide which stacks are kept (-m) */
+				count = 0;
+				total = -1;
+				if (ps->index == SECTION_AQ_STATS) {
+					total = 0;
+					parse_stats(line, eol, &count, &total, sample_rate);
+				}
+				data_ptr = lookup_stack(&ps->frames[start], ps->number_frames - start, ps->lock,
+				    ps->run, total);
+				if (data_ptr == NULL)
+					data_ptr = &other_data;
+				if (ps->index == SECTION_AQ_STATS) {
+					data_ptr->data[ACQ_DATA_HOLD_COUNT] += count;
+					data_ptr->total[TIME_ACQ] += total;
+					hh_update(data_ptr);
+				} else if (ps->index == SECTION_HD_STATS)
+					parse_stats(line, eol, &data_ptr->data[HD_DATA_HOLD_COUNT],
+					    &data_ptr->total[TIME_HOLD], sample_rate);
+				else if (ps->index == SECTION_AQ_HIST || ps->index == SECTION_HD_HIST)
+					ps->hist_entry = data_ptr;
+				else if (ps->index <= SECTION_AQ_SQ_HIGH)
+					parse_squares(data_ptr, ps->index, line, eol);
+				else if (ps->index == ACQ_DATA_HOLD_MAX || ps->index == HD_DATA_HOLD_MAX) {
+					value = parse_number(find_value(line, eol), eol);
+					if (data_ptr->data[ps->index] < value)
+						data_ptr->data[ps->index] = value;
+				} else {
+					value = parse_number(find_value(line, eol), eol);
+					data_ptr->data[ps->index] += value;
+					/* Old data has the average then the count, add the total as it comes */
+					which = (ps->index >= HD_DATA_HOLD_AVG) ? TIME_HOLD : TIME_ACQ;
+					if (ps->index == DATA_INDEX(which, ACQ_DATA_HOLD_COUNT))
+						data_ptr->total[which] += (lock_sum)
+						    data_ptr->data[DATA_INDEX(which, ACQ_DATA_HOLD_AVG)] * value;
+					else
+						ps->averages = 1;
+				}
+			}
+			record = NULL;
+			continue;
+		}
+		/*
+		 * All we need to do is add the function to the stack.
+		 */
+		for (ptr = line; ptr < eol && isspace((unsigned char) ptr[0]); ptr++)
+			;
+		for (last = eol; last > ptr && isspace((unsigned char) last[-1]); last--)
+			;
+		if (ptr == last)
+			continue;
+		if (ps->number_frames == ps->frames_size) {
+			ps->frames_size = ps->frames_size ? ps->frames_size * 2 : 64;
+			ps->frames = (unsigned int *) realloc(ps->frames,
+			    sizeof (unsigned int) * ps->frames_size);
+			if (ps->frames == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		/* The first frame tells us if this is a raw stack */
+		if (ps->number_frames == 0)
+			ps->raw = parse_address(ptr, last - ptr, &address);
+		else if (ps->raw && !parse_address(ptr, last - ptr, &address)) {
+			fprintf(stderr, "malformed raw stack frame: %.*s\n", (int) (last - ptr), ptr);
+			exit(EXIT_FAILURE);
+		}
+		if (ps->raw)
+			ps->frames[ps->number_frames++] = resolve_address(address);
+		else
+			ps->frames[ps->number_frames++] = intern_frame(ptr, last - ptr);
+	}
+	/* Leave an incomplete stack for the next call */
+	if (!final && record) {
+		line = record;
+		mark.lines = record_lines;
+	}
+	section_charge(&mark, ps->index, line);
+	return(line - buf);
+}
+
+/*
+ * Parallel reduction of a data file (-j).  The sections keyed by stack are cut into
+ * pieces at stack boundaries, which the parse threads take one at a time, each into
+ * tables of its own (the thread local lock_data, frame_data, ...).  The rest is parsed
+ * by the main thread as it comes.  The tables are then merged by stack key: the frames
+ * of each thread are given their IDs in the main thread, and the stacks are split into
+ * partitions by a hash of their frame names, so each merge thread can merge every
+ * thread's stacks of its partition into a table of its own.  The partitions are then
+ * put together as the main thread's lock_data.
+ */
+struct parse_piece {
+	const char *start;
+	size_t length;
+	int index;
+};
+
+/*
+ * The tables a thread built, handed over when it is done.  frame_map is the ID in the
+ * main thread of each frame of a parse thread, partition_start where the stacks of
+ * each partition start in partition_entries (the lock_data indices, by partition).
+ * The sampling, totals and the rest after it are the thread's too, what a parse thread
+ * scales the counts by is passed in sample_rate.
+ */
+struct parse_shard {
+	struct lock_info *lock_data;
+	size_t number_lock_entries;
+	size_t *stack_table;
+	struct arena stack_arena;
+	struct frame_info *frame_data;
+	size_t number_frame_entries;
+	size_t *frame_table;
+	struct arena name_arena;
+	struct address_entry *address_table;
+	unsigned int *frame_map;
+	size_t *partition_start;
+	size_t *partition_entries;
+	long sample_rate;
+	long sample_threshold;
+	long totals[8];
+	lock_sum total_times[2];
+	int hist_data;
+	int squares_data;
+	size_t hh_folded;
+	struct lock_info other_data;
+};
+
+#define PARSE_PIECES_PER_THREAD 8
+#define PARSE_PIECE_MIN (1024 * 1024)
+
+static int parse_threads = 1;
+static int release_pieces = 0;
+static struct parse_piece *parse_pieces;
+static size_t number_parse_pieces = 0;
+static size_t parse_pieces_size = 0;
+static size_t next_parse_piece = 0;
+static struct parse_shard *parse_shards;
+static struct parse_shard *merge_shards;
+
+/*
+ * Return 1 if the section index is keyed by stack.
+ */
+static int
+stack_section(int index)
+{
+	return(index >= 0 || index == SECTION_AQ_STATS || index == SECTION_HD_STATS ||
+	    index <= SECTION_AQ_HIST);
+}
+
+/*
+ * Cut the data of a section, index, into pieces of about piece_size for the parse
+ * threads.  The pieces end where a stack starts.
+ */
+static void
+add_parse_pieces(const char *start, const char *end, int index, size_t piece_size)
+{
+	const char *cut;
+
+	while (start < end) {
+		cut = start + piece_size;
+		if (cut >= end)
+			cut = end;
+		else {
+			while ((cut = memchr(cut, '\n', end - cut)) != NULL && cut + 1 < end && cut[1] != '@')
+				cut++;
+			cut = cut && cut + 1 < end ? cut + 1 : end;
+		}
+		if (number_parse_pieces == parse_pieces_size) {
+			parse_pieces_size = parse_pieces_size ? parse_pieces_size * 2 : 64;
+			parse_pieces = (struct parse_piece *) realloc(parse_pieces,
+			    sizeof (struct parse_piece) * parse_pieces_size);
+			if (parse_pieces == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		parse_pieces[number_parse_pieces].start = start;
+		parse_pieces[number_parse_pieces].length = cut - start;
+		parse_pieces[number_parse_pieces].index = index;
+		number_parse_pieces++;
+		start = cut;
+	}
+}
+
+/*
+ * Hand the thread's tables over to shard.
+ */
+static void
+save_shard(struct parse_shard *shard)
+{
+	shard->lock_data = lock_data;
+	shard->number_lock_entries = number_lock_entries;
+	shard->stack_table = stack_table;
+	shard->stack_arena = stack_arena;
+	shard->frame_data = frame_data;
+	shard->number_frame_entries = number_frame_entries;
+	shard->frame_table = frame_table;
+	shard->name_arena = name_arena;
+	shard->address_table = address_table;
+	shard->sample_rate = sample_rate;
+	shard->sample_threshold = sample_threshold;
+	memcpy(shard->totals, totals, sizeof (totals));
+	memcpy(shard->total_times, total_times, sizeof (total_times));
+	shard->hist_data = hist_data;
+	shard->squares_data = squares_data;
+	shard->hh_folded = hh_folded;
+	shard->other_data = other_data;
+}
+
+/*
+ * Work out which partition (of parse_threads) each stack of the thread's lock_data
+ * is merged in, from the names of its frames, and list them by partition.
+ */
+static void
+partition_stacks(struct parse_shard *shard)
+{
+	unsigned long hash;
+	size_t *partition;
+	size_t count;
+	size_t index;
+	int part;
+
+	partition = (size_t *) malloc(sizeof (size_t) * (number_lock_entries + 1));
+	shard->partition_entries = (size_t *) malloc(sizeof (size_t) * (number_lock_entries + 1));
+	shard->partition_start = (size_t *) calloc(parse_threads + 1, sizeof (size_t));
+	if (partition == NULL || shard->partition_entries == NULL || shard->partition_start == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (count = 0; count < number_lock_entries; count++) {
+		hash = (lock_data[count].lock + lock_data[count].run) * 0x9e3779b97f4a7c15UL;
+		for (index = 0; index < lock_data[count].number_frames; index++)
+			hash = (hash ^ frame_data[lock_data[count].frames[index]].hash) * 0x9e3779b97f4a7c15UL;
+		partition[count] = (hash >> 32) % parse_threads;
+		shard->partition_start[partition[count] + 1]++;
+	}
+	for (part = 0; part < parse_threads; part++)
+		shard->partition_start[part + 1] += shard->partition_start[part];
+	for (count = 0; count < number_lock_entries; count++)
+		shard->partition_entries[shard->partition_start[partition[count]]++] = count;
+	/* Filling in moved each start on to the next, move them back */
+	for (part = parse_threads; part > 0; part--)
+		shard->partition_start[part] = shard->partition_start[part - 1];
+	shard->partition_start[0] = 0;
+	free(partition);
+}
+
+/*
+ * A parse thread, parse pieces until there are none left.
+ */
+static void *
+parse_thread(void *arg)
+{
+	struct parse_shard *shard = &parse_shards[(uintptr_t) arg];
+	struct parse_piece *piece;
+	struct parse_state ps;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t first;
+	uintptr_t last;
+	size_t next;
+
+	bzero(&ps, sizeof (struct parse_state));
+	sample_rate = shard->sample_rate;
+	while ((next = __atomic_fetch_add(&next_parse_piece, 1, __ATOMIC_RELAXED)) < number_parse_pieces) {
+		piece = &parse_pieces[next];
+		ps.index = piece->index;
+		ps.title_state = TITLE_NONE;
+		(void) parse_buffer(&ps, piece->start, piece->length, 1);
+		/* Let go of the mapped pages wholly within the piece */
+		first = ((uintptr_t) piece->start + page_size - 1) & ~((uintptr_t) page_size - 1);
+		last = ((uintptr_t) piece->start + piece->length) & ~((uintptr_t) page_size - 1);
+		if (release_pieces && last > first)
+			(void) madvise((void *) first, last - first, MADV_DONTNEED);
+	}
+	free(ps.frames);
+	partition_stacks(shard);
+	save_shard(shard);
+	return(NULL);
+}
+
+/*
+ * Add the data of a stack from another table into the entry for it here.  Data from
+ * old format captures has the averages, the totals are worked out from them again.
+ */
+static void
+merge_entry(struct lock_info *to, struct lock_info *from)
+{
+	int which;
+
+	add_data(to, from);
+	for (which = TIME_ACQ; which <= TIME_HOLD; which++) {
+		to->data[DATA_INDEX(which, ACQ_DATA_HOLD_AVG)] += from->data[DATA_INDEX(which, ACQ_DATA_HOLD_AVG)];
+		if (to->data[DATA_INDEX(which, ACQ_DATA_HOLD_AVG)])
+			to->total[which] = (lock_sum) to->data[DATA_INDEX(which, ACQ_DATA_HOLD_AVG)] *
+			    to->data[DATA_INDEX(which, ACQ_DATA_HOLD_COUNT)];
+	}
+}
+
+/*
+ * A merge thread, merge the stacks of its partition from every parse thread.
+ */
+static void *
+merge_thread(void *arg)
+{
+	size_t part = (uintptr_t) arg;
+	struct parse_shard *shard = &merge_shards[part];
+	struct parse_shard *from;
+	struct lock_info *entry;
+	unsigned int *frames = NULL;
+	size_t frames_size = 0;
+	size_t count;
+	size_t index;
+	int thread;
+
+	for (thread = 0; thread < parse_threads; thread++) {
+		from = &parse_shards[thread];
+		for (count = from->partition_start[part]; count < from->partition_start[part + 1]; count++) {
+			entry = &from->lock_data[from->partition_entries[count]];
+			if (entry->number_frames > frames_size) {
+				frames_size = entry->number_frames * 2;
+				frames = (unsigned int *) realloc(frames, sizeof (unsigned int) * frames_size);
+				if (frames == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			for (index = 0; index < entry->number_frames; index++)
+				frames[index] = from->frame_map[entry->frames[index]];
+			merge_entry(lookup_stack(frames, entry->number_frames, entry->lock, entry->run,
+			    entry->total[TIME_ACQ]), entry);
+			hist_free(entry->hist);
+		}
+	}
+	free(frames);
+	save_shard(shard);
+	return(NULL);
+}
+
+/*
+ * Start parse_threads threads running routine, each passed its number, and wait for
+ * them.
+ */
+static void
+run_threads(void *(*routine)(void *))
+{
+	pthread_t *threads;
+	int thread;
+	int error;
+
+	threads = (pthread_t *) malloc(sizeof (pthread_t) * parse_threads);
+	if (threads == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (thread = 0; thread < parse_threads; thread++) {
+		error = pthread_create(&threads[thread], NULL, routine, (void *) (uintptr_t) thread);
+		if (error) {
+			errno = error;
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (thread = 0; thread < parse_threads; thread++)
+		(void) pthread_join(threads[thread], NULL);
+	free(threads);
+}
+
+/*
+ * Merge the tables the threads left in parse_shards into the main thread's, which are
+ * expected to be empty, see above.
+ */
+static void
+merge_parse_shards()
+{
+	struct parse_shard *shard;
+	size_t count;
+	size_t offset;
+	int thread;
+
+	/* Give the frames of each thread their IDs here */
+	for (thread = 0; thread < parse_threads; thread++) {
+		shard = &parse_shards[thread];
+		shard->frame_map = (unsigned int *) malloc(sizeof (unsigned int) *
+		    (shard->number_frame_entries + 1));
+		if (shard->frame_map == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		for (count = 0; count < shard->number_frame_entries; count++)
+			shard->frame_map[count] = intern_frame(shard->frame_data[count].name,
+			    shard->frame_data[count].length);
+		free(shard->frame_data);
+		free(shard->frame_table);
+		free(shard->address_table);
+		arena_free(&shard->name_arena);
+	}
+
+	run_threads(merge_thread);
+
+	for (thread = 0; thread < parse_threads; thread++) {
+		shard = &parse_shards[thread];
+		free(shard->lock_data);
+		free(shard->stack_table);
+		free(shard->frame_map);
+		free(shard->partition_start);
+		free(shard->partition_entries);
+		arena_free(&shard->stack_arena);
+	}
+
+	/* Put the partitions together */
+	for (thread = 0; thread < parse_threads; thread++)
+		lock_data_size += merge_shards[thread].number_lock_entries;
+	lock_data = (struct lock_info *) realloc(lock_data, sizeof (struct lock_info) * (lock_data_size + 1));
+	if (lock_data == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	for (thread = 0, offset = 0; thread < parse_threads; thread++) {
+		shard = &merge_shards[thread];
+		memcpy(&lock_data[offset], shard->lock_data, sizeof (struct lock_info) * shard->number_lock_entries);
+		offset += shard->number_lock_entries;
+		free(shard->lock_data);
+		free(shard->stack_table);
+		arena_adopt(&stack_arena, &shard->stack_arena);
+	}
+	number_lock_entries = offset;
+	grow_stack_table();
+
+	free(parse_shards);
+	free(merge_shards);
+}
+
+/*
+ * Reduce the data in buf with parse_threads threads, see above.  The main thread's
+ * tables are expected to be empty, as they are before the first report.  If mapped
+ * is set, buf is a mapping of the file, and the pages are let go once parsed.
+ */
+static void
+parse_parallel(struct parse_state *ps, const char *buf, size_t len, int mapped)
+{
+	const char *end = buf + len;
+	const char *start = buf;
+	const char *header;
+	const char *ptr;
+	size_t piece_size;
+	int thread;
+	int lines;
+
+	piece_size = len / (parse_threads * PARSE_PIECES_PER_THREAD);
+	if (piece_size < PARSE_PIECE_MIN)
+		piece_size = PARSE_PIECE_MIN;
+	number_parse_pieces = next_parse_piece = 0;
+	release_pieces = mapped;
+
+	/* Find the section headers, a title between two lines of '=' */
+	while (start < end) {
+		for (header = start; (header = memchr(header, '=', end - header)) != NULL; header++)
+			if (header == buf || header[-1] == '\n')
+				break;
+		if (header == NULL)
+			header = end;
+		if (stack_section(ps->index))
+			add_parse_pieces(start, header, ps->index, piece_size);
+		else if (header > start)
+			(void) parse_buffer(ps, start, header - start, 1);
+		for (ptr = header, lines = 0; ptr < end && lines < 3; lines++) {
+			ptr = memchr(ptr, '\n', end - ptr);
+			ptr = ptr ? ptr + 1 : end;
+		}
+		if (ptr > header)
+			(void) parse_buffer(ps, header, ptr - header, 1);
+		start = ptr;
+	}
+
+	parse_shards = (struct parse_shard *) calloc(parse_threads, sizeof (struct parse_shard));
+	merge_shards = (struct parse_shard *) calloc(parse_threads, sizeof (struct parse_shard));
+	if (parse_shards == NULL || merge_shards == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (thread = 0; thread < parse_threads; thread++)
+		parse_shards[thread].sample_rate = sample_rate;
+	run_threads(parse_thread);
+	merge_parse_shards();
+
+	free(parse_pieces);
+	parse_pieces = NULL;
+	parse_pieces_size = 0;
+}
+
+/*
+ * The captures (-f, and -D) reduced into one table, see merge_captures(), and the run
+ * each is reduced as.  run_names is what each is called in the Run column, by run (so
+ * from index 1), when the data is keyed by capture (-R).  Compared (-D), the runs are
+ * DIFF_BASELINE and DIFF_CANDIDATE, see dump_diff().
+ */
+#define DIFF_BASELINE 1
+#define DIFF_CANDIDATE 2
+
+static char **capture_files;
+static unsigned int *capture_runs;
+static size_t number_captures = 0;
+static size_t next_capture = 0;
+static const char **run_names;
+
+/*
+ * Binary snapshot of the reduced data (-w), which -f loads in place of bpftrace output,
+ * so the same capture can be reported on again without parsing it.  The file is a
+ * struct snapshot_header then, each at the offset the header gives, 8 byte aligned:
+ *   frame_offsets  uint64_t [number_frames + 1], where each frame's name starts in
+ *                  frame_names
+ *   frame_names    the frame names, back to back
+ *   stack_offsets  uint64_t [number_stacks + 1], where each stack starts in stack_frames
+ *   stack_frames   uint32_t frame IDs, indices in the frame table
+ *   column_data    int64_t [SNAP_COLUMNS][number_stacks + 1], a column per metric, the
+ *                  last row being [other] (-m)
+ *   hist_offsets   uint64_t [2][number_stacks + 2], where the acquire then the hold
+ *                  buckets of each row start in hist_buckets
+ *   hist_buckets   struct hist_bucket []
+ * The 128 bit sums take two columns, the low then the high half.  The stack hashes are
+ * saved with the stacks, the version is to be bumped if hash_key() ever changes.
+ */
+#define SNAPSHOT_MAGIC "LOCKSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+#define SNAP_LOCK 0
+#define SNAP_HASH 1
+#define SNAP_ACQ_COUNT 2
+#define SNAP_ACQ_MAX 3
+#define SNAP_HOLD_COUNT 4
+#define SNAP_HOLD_MAX 5
+#define SNAP_ACQ_TOTAL 6
+#define SNAP_HOLD_TOTAL 8
+#define SNAP_ACQ_SQUARES 10
+#define SNAP_HOLD_SQUARES 12
+#define SNAP_ERROR 14
+#define SNAP_COLUMNS 16
+
+#define SNAP_HIST 0x1
+#define SNAP_SQUARES_DATA 0x2
+
+#define SNAP_ALIGN(size) (((size) + 7) & ~((uint64_t) 7))
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t file_size;
+	int64_t created;
+	int64_t sample_rate;
+	int64_t sample_threshold;
+	int64_t totals[8];
+	int64_t total_times[2][2];
+	uint32_t flags;
+	uint32_t columns;
+	uint64_t budget;
+	uint64_t folded;
+	uint64_t number_frames;
+	uint64_t number_stacks;
+	uint64_t number_stack_frames;
+	uint64_t number_buckets;
+	uint64_t frame_offsets;
+	uint64_t frame_names;
+	uint64_t stack_offsets;
+	uint64_t stack_frames;
+	uint64_t column_data;
+	uint64_t hist_offsets;
+	uint64_t hist_buckets;
+	char host[64];
+	char source[256];
+};
+
+/*
+ * Where the sections of a snapshot being loaded are.
+ */
+struct snapshot {
+	const struct snapshot_header *header;
+	size_t number_rows;
+	const uint64_t *frame_offsets;
+	const char *frame_names;
+	const uint64_t *stack_offsets;
+	const uint32_t *stack_frames;
+	const int64_t *column_data;
+	const uint64_t *hist_offsets;
+	const struct hist_bucket *hist_buckets;
+};
+
+/*
+ * Where the data came from, the capture metadata of a snapshot or how many captures
+ * were merged, reported along with the data.
+ */
+static char capture_info[512];
+
+/*
+ * Value of column of the row of entry.
+ */
+static int64_t
+snapshot_value(struct lock_info *entry, int column)
+{
+	lock_sum sum;
+
+	switch (column) {
+		case SNAP_LOCK:
+			return((int64_t) entry->lock);
+		case SNAP_HASH:
+			return((int64_t) entry->hash);
+		case SNAP_ACQ_COUNT:
+			return(entry->data[ACQ_DATA_HOLD_COUNT]);
+		case SNAP_ACQ_MAX:
+			return(entry->data[ACQ_DATA_HOLD_MAX]);
+		case SNAP_HOLD_COUNT:
+			return(entry->data[HD_DATA_HOLD_COUNT]);
+		case SNAP_HOLD_MAX:
+			return(entry->data[HD_DATA_HOLD_MAX]);
+		case SNAP_ACQ_TOTAL:
+		case SNAP_ACQ_TOTAL + 1:
+			sum = entry->total[TIME_ACQ];
+		break;
+		case SNAP_HOLD_TOTAL:
+		case SNAP_HOLD_TOTAL + 1:
+			sum = entry->total[TIME_HOLD];
+		break;
+		case SNAP_ACQ_SQUARES:
+		case SNAP_ACQ_SQUARES + 1:
+			sum = entry->squares[TIME_ACQ];
+		break;
+		case SNAP_HOLD_SQUARES:
+		case SNAP_HOLD_SQUARES + 1:
+			sum = entry->squares[TIME_HOLD];
+		break;
+		default:
+			sum = entry->error;
+		break;
+	}
+	/* The odd column of a sum is the high half */
+	if (column & 1)
+		return((int64_t) (sum >> 64));
+	return((int64_t) (uint64_t) sum);
+}
+
+static lock_sum
+join_sum(const int64_t *low, size_t number_rows)
+{
+	return((lock_sum) (((unsigned __int128) (uint64_t) low[number_rows] << 64) | (uint64_t) low[0]));
+}
+
+/*
+ * Fill in entry (zeroed) from row of the snapshot, all but its stack.
+ */
+static void
+load_row(const struct snapshot *snap, size_t row, struct lock_info *entry)
+{
+	const int64_t *value = &snap->column_data[row];
+	size_t rows = snap->number_rows;
+	const struct hist_bucket *bucket;
+	const struct hist_bucket *last;
+	int which;
+
+	entry->lock = (unsigned long) value[SNAP_LOCK * rows];
+	entry->hash = (unsigned long) value[SNAP_HASH * rows];
+	entry->data[ACQ_DATA_HOLD_COUNT] = value[SNAP_ACQ_COUNT * rows];
+	entry->data[ACQ_DATA_HOLD_MAX] = value[SNAP_ACQ_MAX * rows];
+	entry->data[HD_DATA_HOLD_COUNT] = value[SNAP_HOLD_COUNT * rows];
+	entry->data[HD_DATA_HOLD_MAX] = value[SNAP_HOLD_MAX * rows];
+	entry->total[TIME_ACQ] = join_sum(&value[SNAP_ACQ_TOTAL * rows], rows);
+	entry->total[TIME_HOLD] = join_sum(&value[SNAP_HOLD_TOTAL * rows], rows);
+	entry->squares[TIME_ACQ] = join_sum(&value[SNAP_ACQ_SQUARES * rows], rows);
+	entry->squares[TIME_HOLD] = join_sum(&value[SNAP_HOLD_SQUARES * rows], rows);
+	entry->error = join_sum(&value[SNAP_ERROR * rows], rows);
+	for (which = TIME_ACQ; which <= TIME_HOLD; which++) {
+		bucket = &snap->hist_buckets[snap->hist_offsets[which * (rows + 1) + row]];
+		last = &snap->hist_buckets[snap->hist_offsets[which * (rows + 1) + row + 1]];
+		for (; bucket < last; bucket++)
+			hist_add(&entry->hist, which, bucket->low, bucket->high, bucket->count);
+	}
+}
+
+/*
+ * Write size bytes of data to the snapshot, padded to 8 bytes.  If data is NULL, the
+ * size bytes were written already, only pad them.
+ */
+static void
+write_snapshot(FILE *fd, const void *data, size_t size)
+{
+	static const char zeros[8];
+
+	if (data && size && fwrite(data, size, 1, fd) != 1) {
+		perror("fwrite");
+		exit(EXIT_FAILURE);
+	}
+	if (SNAP_ALIGN(size) != size && fwrite(zeros, SNAP_ALIGN(size) - size, 1, fd) != 1) {
+		perror("fwrite");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Write a snapshot of lock_data, of the frames and the sampling with it, to file.
+ * source is what the data was captured from, the data file or the command.
+ */
+static void
+save_snapshot(const char *file, const char *source)
+{
+	struct snapshot_header header;
+	struct lock_info *entry;
+	uint64_t *offsets;
+	int64_t *column;
+	size_t number_rows = number_lock_entries + 1;
+	size_t names_size = 0;
+	size_t count;
+	size_t row;
+	FILE *fd;
+	int which;
+	int index;
+
+	bzero(&header, sizeof (header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof (header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order = SNAPSHOT_BYTE_ORDER;
+	header.created = time(NULL);
+	header.sample_rate = sample_rate;
+	header.sample_threshold = sample_threshold;
+	for (index = 0; index < 8; index++)
+		header.totals[index] = totals[index];
+	for (which = TIME_ACQ; which <= TIME_HOLD; which++) {
+		header.total_times[which][0] = (int64_t) (uint64_t) total_times[which];
+		header.total_times[which][1] = (int64_t) (total_times[which] >> 64);
+	}
+	header.flags = (hist_data ? SNAP_HIST : 0) | (squares_data ? SNAP_SQUARES_DATA : 0);
+	header.columns = SNAP_COLUMNS;
+	header.budget = hh_budget;
+	header.folded = hh_folded;
+	header.number_frames = number_frame_entries;
+	header.number_stacks = number_lock_entries;
+	for (count = 0; count < number_frame_entries; count++)
+		names_size += frame_data[count].length;
+	for (count = 0; count < number_lock_entries; count++)
+		header.number_stack_frames += lock_data[count].number_frames;
+	for (row = 0; row < number_rows; row++) {
+		entry = (row < number_lock_entries) ? &lock_data[row] : &other_data;
+		for (which = TIME_ACQ; entry->hist && which <= TIME_HOLD; which++)
+			header.number_buckets += entry->hist->number[which];
+	}
+	(void) gethostname(header.host, sizeof (header.host) - 1);
+	(void) strncpy(header.source, source, sizeof (header.source) - 1);
+
+	header.frame_offsets = SNAP_ALIGN(sizeof (header));
+	header.frame_names = header.frame_offsets + SNAP_ALIGN(sizeof (uint64_t) * (number_frame_entries + 1));
+	header.stack_offsets = header.frame_names + SNAP_ALIGN(names_size);
+	header.stack_frames = header.stack_offsets + SNAP_ALIGN(sizeof (uint64_t) * (number_lock_entries + 1));
+	header.column_data = header.stack_frames + SNAP_ALIGN(sizeof (uint32_t) * header.number_stack_frames);
+	header.hist_offsets = header.column_data + sizeof (int64_t) * SNAP_COLUMNS * number_rows;
+	header.hist_buckets = header.hist_offsets + sizeof (uint64_t) * 2 * (number_rows + 1);
+	header.file_size = header.hist_buckets + sizeof (struct hist_bucket) * header.number_buckets;
+
+	count = (number_frame_entries > number_rows) ? number_frame_entries : number_rows;
+	offsets = (uint64_t *) malloc(sizeof (uint64_t) * (count + 1));
+	column = (int64_t *) malloc(sizeof (int64_t) * number_rows);
+	if (offsets == NULL || column == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	fd = fopen(file, "w");
+	if (fd == NULL) {
+		perror(file);
+		exit(EXIT_FAILURE);
+	}
+	write_snapshot(fd, &header, sizeof (header));
+
+	/* The frame table */
+	for (offsets[0] = 0, count = 0; count < number_frame_entries; count++)
+		offsets[count + 1] = offsets[count] + frame_data[count].length;
+	write_snapshot(fd, offsets, sizeof (uint64_t) * (number_frame_entries + 1));
+	for (count = 0; count < number_frame_entries; count++) {
+		if (fwrite(frame_data[count].name, frame_data[count].length, 1, fd) != 1) {
+			perror("fwrite");
+			exit(EXIT_FAILURE);
+		}
+	}
+	write_snapshot(fd, NULL, names_size);
+
+	/* The stacks */
+	for (offsets[0] = 0, count = 0; count < number_lock_entries; count++)
+		offsets[count + 1] = offsets[count] + lock_data[count].number_frames;
+	write_snapshot(fd, offsets, sizeof (uint64_t) * (number_lock_entries + 1));
+	for (count = 0; count < number_lock_entries; count++) {
+		if (fwrite(lock_data[count].frames, sizeof (uint32_t) * lock_data[count].number_frames,
+		    1, fd) != 1) {
+			perror("fwrite");
+			exit(EXIT_FAILURE);
+		}
+	}
+	write_snapshot(fd, NULL, sizeof (uint32_t) * header.number_stack_frames);
+
+	/* The metrics, a column at a time */
+	for (index = 0; index < SNAP_COLUMNS; index++) {
+		for (row = 0; row < number_rows; row++)
+			column[row] = snapshot_value((row < number_lock_entries) ? &lock_data[row] : &other_data,
+			    index);
+		write_snapshot(fd, column, sizeof (int64_t) * number_rows);
+	}
+
+	/* The histograms, the acquire buckets of every row then the hold buckets */
+	for (offsets[0] = 0, which = TIME_ACQ; which <= TIME_HOLD; which++) {
+		for (row = 0; row < number_rows; row++) {
+			entry = (row < number_lock_entries) ? &lock_data[row] : &other_data;
+			offsets[row + 1] = offsets[row] + (entry->hist ? entry->hist->number[which] : 0);
+		}
+		write_snapshot(fd, offsets, sizeof (uint64_t) * (number_rows + 1));
+		offsets[0] = offsets[number_rows];
+	}
+	for (which = TIME_ACQ; which <= TIME_HOLD; which++) {
+		for (row = 0; row < number_rows; row++) {
+			entry = (row < number_lock_entries) ? &lock_data[row] : &other_data;
+			if (entry->hist && entry->hist->number[which] && fwrite(entry->hist->buckets[which],
+			    sizeof (struct hist_bucket) * entry->hist->number[which], 1, fd) != 1) {
+				perror("fwrite");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	if (fclose(fd) != 0) {
+		perror(file);
+		exit(EXIT_FAILURE);
+	}
+	free(offsets);
+	free(column);
+}
+
+/*
+ * Return 1 if the len bytes at buf are a snapshot.
+ */
+static int
+is_snapshot(const char *buf, size_t len)
+{
+	return(len >= sizeof (struct snapshot_header) &&
+	    memcmp(buf, SNAPSHOT_MAGIC, sizeof (((struct snapshot_header *) 0)->magic)) == 0);
+}
+
+/*
+ * Check that the section of number items of size bytes at offset is within the len
+ * bytes of the snapshot.
+ */
+static int
+snapshot_section(uint64_t offset, uint64_t number, size_t size, size_t len)
+{
+	return(offset % 8 == 0 && offset <= len && number <= (len - offset) / size);
+}
+
+/*
+ * Load the snapshot of len bytes at buf, read from file, into lock_data as capture
+ * run.  Into empty tables, without a stack budget or other captures, the stacks are
+ * used in place, and 1 is returned: buf has to be kept.  Otherwise each stack is
+ * added in as if it had been parsed, and 0 is returned.
+ */
+static int
+load_snapshot(const char *file, const char *buf, size_t len, unsigned int run)
+{
+	const struct snapshot_header *header = (const struct snapshot_header *) buf;
+	struct snapshot snap;
+	struct lock_info entry;
+	struct lock_info *data_ptr;
+	unsigned int *frame_map;
+	unsigned int *frames = NULL;
+	size_t frames_size = 0;
+	size_t number_frames;
+	size_t count;
+	size_t index;
+	lock_sum weight;
+	lock_sum lightest = -1;
+	char created[64];
+	time_t when;
+	int in_place;
+
+	snap.header = header;
+	snap.number_rows = header->number_stacks + 1;
+	if (header->version != SNAPSHOT_VERSION || header->byte_order != SNAPSHOT_BYTE_ORDER ||
+	    header->columns != SNAP_COLUMNS || header->file_size != len ||
+	    header->number_stacks >= len || header->number_frames >= len ||
+	    !snapshot_section(header->frame_offsets, header->number_frames + 1, sizeof (uint64_t), len) ||
+	    !snapshot_section(header->stack_offsets, header->number_stacks + 1, sizeof (uint64_t), len) ||
+	    !snapshot_section(header->stack_frames, header->number_stack_frames, sizeof (uint32_t), len) ||
+	    !snapshot_section(header->column_data, snap.number_rows * SNAP_COLUMNS, sizeof (int64_t), len) ||
+	    !snapshot_section(header->hist_offsets, 2 * (snap.number_rows + 1), sizeof (uint64_t), len) ||
+	    !snapshot_section(header->hist_buckets, header->number_buckets, sizeof (struct hist_bucket), len)) {
+		fprintf(stderr, "%s: not a snapshot this version can read\n", file);
+		exit(EXIT_FAILURE);
+	}
+	snap.frame_offsets = (const uint64_t *) (buf + header->frame_offsets);
+	snap.frame_names = buf + header->frame_names;
+	snap.stack_offsets = (const uint64_t *) (buf + header->stack_offsets);
+	snap.stack_frames = (const uint32_t *) (buf + header->stack_frames);
+	snap.column_data = (const int64_t *) (buf + header->column_data);
+	snap.hist_offsets = (const uint64_t *) (buf + header->hist_offsets);
+	snap.hist_buckets = (const struct hist_bucket *) (buf + header->hist_buckets);
+
+	/* Make sure the frame table, stacks and histograms stay within the file */
+	for (count = 0; count < header->number_frames; count++)
+		if (snap.frame_offsets[count] > snap.frame_offsets[count + 1] ||
+		    snap.frame_offsets[count + 1] > len - header->frame_names)
+			break;
+	for (index = 0; count == header->number_frames && index < header->number_stacks; index++)
+		if (snap.stack_offsets[index] > snap.stack_offsets[index + 1] ||
+		    snap.stack_offsets[index + 1] > header->number_stack_frames)
+			break;
+	for (number_frames = 0; number_frames < header->number_stack_frames; number_frames++)
+		if (snap.stack_frames[number_frames] >= header->number_frames)
+			break;
+	if (count != header->number_frames || index != header->number_stacks ||
+	    number_frames != header->number_stack_frames) {
+		fprintf(stderr, "%s: snapshot is corrupt\n", file);
+		exit(EXIT_FAILURE);
+	}
+	for (count = 0; count < 2 * (snap.number_rows + 1); count++) {
+		if (snap.hist_offsets[count] > header->number_buckets ||
+		    (count % (snap.number_rows + 1) && snap.hist_offsets[count] < snap.hist_offsets[count - 1])) {
+			fprintf(stderr, "%s: snapshot is corrupt\n", file);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	sample_rate = header->sample_rate;
+	sample_threshold = header->sample_threshold;
+	for (count = 0; count < 8; count++)
+		totals[count] += header->totals[count];
+	total_times[TIME_ACQ] += join_sum(&header->total_times[TIME_ACQ][0], 1);
+	total_times[TIME_HOLD] += join_sum(&header->total_times[TIME_HOLD][0], 1);
+	if (header->flags & SNAP_HIST)
+		hist_data = 1;
+	if (header->flags & SNAP_SQUARES_DATA)
+		squares_data = 1;
+	if (header->budget && hh_budget == 0 && number_captures <= 1)
+		hh_budget = header->budget;
+	hh_folded += header->folded;
+	hh_new_epoch();
+
+	/* Give the frames their IDs, they are the same as in the snapshot in a fresh table */
+	frame_map = (unsigned int *) malloc(sizeof (unsigned int) * (header->number_frames + 1));
+	if (frame_map == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	in_place = (number_lock_entries == 0 && hh_budget == 0 && number_captures <= 1);
+	for (count = 0; count < header->number_frames; count++) {
+		frame_map[count] = intern_frame(snap.frame_names + snap.frame_offsets[count],
+		    snap.frame_offsets[count + 1] - snap.frame_offsets[count]);
+		if (frame_map[count] != count)
+			in_place = 0;
+	}
+
+	if (in_place) {
+		lock_data_size = number_lock_entries = header->number_stacks;
+		lock_data = (struct lock_info *) calloc(lock_data_size + 1, sizeof (struct lock_info));
+		if (lock_data == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for (count = 0; count < number_lock_entries; count++) {
+			load_row(&snap, count, &lock_data[count]);
+			lock_data[count].frames = (unsigned int *) &snap.stack_frames[snap.stack_offsets[count]];
+			lock_data[count].number_frames = snap.stack_offsets[count + 1] - snap.stack_offsets[count];
+		}
+		grow_stack_table();
+	} else {
+		for (count = 0; count < header->number_stacks; count++) {
+			number_frames = snap.stack_offsets[count + 1] - snap.stack_offsets[count];
+			if (number_frames > frames_size) {
+				frames_size = number_frames * 2;
+				frames = (unsigned int *) realloc(frames, sizeof (unsigned int) * frames_size);
+				if (frames == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			for (index = 0; index < number_frames; index++)
+				frames[index] = frame_map[snap.stack_frames[snap.stack_offsets[count] + index]];
+			bzero(&entry, sizeof (entry));
+			load_row(&snap, count, &entry);
+			weight = entry.total[TIME_ACQ] + entry.error;
+			if (lightest < 0 || weight < lightest)
+				lightest = weight;
+			data_ptr = lookup_stack(frames, number_frames, entry.lock, run, weight);
+			if (data_ptr == NULL) {
+				/* other_data is exact, it has no error of its own */
+				entry.error = 0;
+				data_ptr = &other_data;
+			}
+			add_data(data_ptr, &entry);
+			hh_update(data_ptr);
+			hist_free(entry.hist);
+		}
+		free(frames);
+	}
+	free(frame_map);
+
+	/*
+	 * The stacks the snapshot folded had no more than its lightest stack kept, any
+	 * stack it does not have may be one of them.
+	 */
+	if (hh_budget && header->folded && lightest >= 0) {
+		for (count = 0; count < number_lock_entries; count++) {
+			if (hh_seen[count] != hh_epoch) {
+				lock_data[count].error += lightest;
+				hh_update(&lock_data[count]);
+			}
+		}
+		if (hh_fold_max < hh_prior_error + lightest)
+			hh_fold_max = hh_prior_error + lightest;
+	}
+
+	/* And what did not fit the stack budget */
+	bzero(&entry, sizeof (entry));
+	load_row(&snap, header->number_stacks, &entry);
+	add_data(&other_data, &entry);
+	hist_free(entry.hist);
+
+	if (number_captures <= 1) {
+		when = (time_t) header->created;
+		(void) strftime(created, sizeof (created), "%F %T", localtime(&when));
+		(void) snprintf(capture_info, sizeof (capture_info),
+		    "Snapshot of %.256s on %.64s, taken %s\n", header->source, header->host, created);
+	}
+	return(in_place);
+}
+
+/*
+ * Read the bpftrace output file in and reduce it into lock_data.  Regular files are
+ * mapped and scanned in place, anything else (a pipe for instance) is read in whole.
+ * The data is parsed PARSE_CHUNK bytes at a time so the mapped pages already parsed
+ * can be released as we go.  With -j, the file is reduced in parallel, unless it is
+ * reported on interval by interval or there is a stack budget (-m), the budget
+ * being over the stacks in the order they come, or when it is one of several
+ * captures merged (these are reduced in parallel instead).  A snapshot (-w) is loaded
+ * instead.  The data is keyed by run (-R).
+ */
+static void
+lookup_data(char *file, unsigned int run, void (*end_of_data)(void))
+{
+	struct parse_state ps;
+	struct stat st;
+	char *buf = NULL;
+	size_t len = 0;
+	size_t buf_size = 0;
+	size_t offset;
+	size_t chunk;
+	size_t used;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	ssize_t bytes;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(file);
+		exit(EXIT_FAILURE);
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		len = st.st_size;
+		if (len) {
+			buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (buf == MAP_FAILED) {
+				perror(file);
+				exit(EXIT_FAILURE);
+			}
+			(void) madvise(buf, len, MADV_SEQUENTIAL);
+		}
+	} else {
+		for (;;) {
+			if (len == buf_size) {
+				buf_size = buf_size ? buf_size * 2 : 1024 * 1024;
+				buf = (char *) realloc(buf, buf_size);
+				if (buf == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			bytes = read(fd, buf + len, buf_size - len);
+			if (bytes < 0) {
+				perror(file);
+				exit(EXIT_FAILURE);
+			}
+			if (bytes == 0)
+				break;
+			len += bytes;
+		}
+	}
+	(void) close(fd);
+	(void) __atomic_fetch_add(&input_bytes, (long) len, __ATOMIC_RELAXED);
+
+	bzero(&ps, sizeof (struct parse_state));
+	ps.index = -1;
+	ps.end_of_data = end_of_data;
+	ps.run = run;
+	if (is_snapshot(buf, len)) {
+		/* The stacks may be used where they are, in which case buf stays */
+		if (load_snapshot(file, buf, len, run))
+			return;
+	} else if (parse_threads > 1 && end_of_data == NULL && hh_budget == 0 && number_captures <= 1) {
+		parse_parallel(&ps, buf, len, S_ISREG(st.st_mode));
+	} else {
+		for (offset = 0; offset < len; offset += used) {
+			chunk = PARSE_CHUNK;
+			do {
+				if (chunk > len - offset)
+					chunk = len - offset;
+				used = parse_buffer(&ps, buf + offset, chunk, offset + chunk == len);
+				/* A single stack larger than the chunk, try again with more */
+				chunk *= 2;
+			} while (used == 0);
+			/*
+			 * Let go of the pages parsed, nothing refers back to them.
+			 */
+			if (S_ISREG(st.st_mode))
+				(void) madvise(buf, (offset + used) & ~(page_size - 1), MADV_DONTNEED);
+		}
+	}
+	free(ps.frames);
+	if (S_ISREG(st.st_mode)) {
+		if (len)
+			(void) munmap(buf, len);
+	} else
+		free(buf);
+
+	/*
+	 * The totals of old data are in, let go of its averages so the next capture's
+	 * are added up on their own.
+	 */
+	if (ps.averages && number_captures > 1) {
+		for (offset = 0; offset < number_lock_entries; offset++) {
+			lock_data[offset].data[ACQ_DATA_HOLD_AVG] = 0;
+			lock_data[offset].data[HD_DATA_HOLD_AVG] = 0;
+		}
+	}
+}
+
+/*
+ * Merging captures (-f given more than once, say one per host).  Each capture is
+ * reduced in turn by lookup_data(), its file mapped, parsed and let go, so only the
+ * one being read is in memory whatever the number of captures.  With -j the captures
+ * are shared out between the threads, each reducing those it takes into tables of its
+ * own, which are then merged as those of a single data file are, see parse_parallel().
+ * The counts, sums and histograms add up exactly and the maxima are the largest.  Each
+ * capture may have been sampled differently, the counts of each are scaled as it is
+ * read, the sampling reported is the coarsest.
+ */
+
+/*
+ * Reduce capture number capture, keeping the coarsest sampling yet in *rate and
+ * *threshold.
+ */
+static void
+reduce_capture(size_t capture, long *rate, long *threshold)
+{
+	sample_rate = 1;
+	sample_threshold = 0;
+	lookup_data(capture_files[capture], capture_runs[capture], NULL);
+	if (*rate < sample_rate)
+		*rate = sample_rate;
+	if (*threshold < sample_threshold)
+		*threshold = sample_threshold;
+}
+
+/*
+ * A capture thread, reduce captures until there are none left.
+ */
+static void *
+capture_thread(void *arg)
+{
+	struct parse_shard *shard = &parse_shards[(uintptr_t) arg];
+	long rate = 1;
+	long threshold = 0;
+	size_t next;
+
+	while ((next = __atomic_fetch_add(&next_capture, 1, __ATOMIC_RELAXED)) < number_captures)
+		reduce_capture(next, &rate, &threshold);
+	sample_rate = rate;
+	sample_threshold = threshold;
+	partition_stacks(shard);
+	save_shard(shard);
+	return(NULL);
+}
+
+/*
+ * Reduce all the captures into lock_data, see above.  With a stack budget (-m) the
+ * captures are reduced one after the other, the budget being over all of them.
+ */
+static void
+merge_captures()
+{
+	struct parse_shard *shard;
+	long rate = 1;
+	long threshold = 0;
+	size_t capture;
+	int thread;
+	int index;
+
+	if (parse_threads == 1 || hh_budget) {
+		for (capture = 0; capture < number_captures; capture++)
+			reduce_capture(capture, &rate, &threshold);
+	} else {
+		parse_shards = (struct parse_shard *) calloc(parse_threads, sizeof (struct parse_shard));
+		merge_shards = (struct parse_shard *) calloc(parse_threads, sizeof (struct parse_shard));
+		if (parse_shards == NULL || merge_shards == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		next_capture = 0;
+		run_threads(capture_thread);
+		for (thread = 0; thread < parse_threads; thread++) {
+			shard = &parse_shards[thread];
+			if (rate < shard->sample_rate)
+				rate = shard->sample_rate;
+			if (threshold < shard->sample_threshold)
+				threshold = shard->sample_threshold;
+			for (index = 0; index < 8; index++)
+				totals[index] += shard->totals[index];
+			total_times[TIME_ACQ] += shard->total_times[TIME_ACQ];
+			total_times[TIME_HOLD] += shard->total_times[TIME_HOLD];
+			hist_data |= shard->hist_data;
+			squares_data |= shard->squares_data;
+			hh_folded += shard->hh_folded;
+			add_data(&other_data, &shard->other_data);
+			hist_free(shard->other_data.hist);
+		}
+		merge_parse_shards();
+	}
+	sample_rate = rate;
+	sample_threshold = threshold;
+	(void) snprintf(capture_info, sizeof (capture_info), "Merged %zu captures\n", number_captures);
+	if (report.diff) {
+		for (capture = 0; capture_runs[capture] != DIFF_BASELINE; capture++)
+			;
+		for (index = 0; capture_runs[index] != DIFF_CANDIDATE; index++)
+			;
+		(void) snprintf(capture_info, sizeof (capture_info), "Baseline %.200s, candidate %.200s\n",
+		    capture_files[capture], capture_files[index]);
+	}
+}
+
+/*
+ * Set up to reduce the bpftrace output as it arrives on a pipe.  If file is not
+ * NULL the raw output is saved there as well.
+ */
+static void
+stream_init(struct stream_state *ss, char *file, void (*end_of_data)(void))
+{
+	bzero(ss, sizeof (struct stream_state));
+	ss->ps.index = -1;
+	ss->ps.end_of_data = end_of_data;
+	ss->tee_fd = -1;
+	if (file) {
+		ss->tee_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (ss->tee_fd < 0)
+			perror(file);
+	}
+}
+
+/*
+ * Read what is available from fd, and reduce every complete stack received.
+ * Returns 0 once end of file is reached, 1 otherwise.
+ */
+static int
+stream_read(struct stream_state *ss, int fd)
+{
+	ssize_t bytes;
+	size_t used;
+	int previous;
+
+	if (ss->size - ss->len < STREAM_READ_SIZE) {
+		ss->size = ss->size ? ss->size * 2 : 2 * STREAM_READ_SIZE;
+		ss->buf = (char *) realloc(ss->buf, ss->size);
+		if (ss->buf == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	bytes = read(fd, ss->buf + ss->len, ss->size - ss->len);
+	if (bytes < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return(1);
+		perror("read");
+		bytes = 0;
+	}
+	if (bytes && ss->tee_fd >= 0 &&
+	    write(ss->tee_fd, ss->buf + ss->len, bytes) != bytes) {
+		perror("write");
+		(void) close(ss->tee_fd);
+		ss->tee_fd = -1;
+	}
+	ss->len += bytes;
+	input_bytes += bytes;
+	previous = phase_begin(PHASE_PARSE);
+	used = parse_buffer(&ss->ps, ss->buf, ss->len, bytes == 0);
+	(void) phase_begin(previous);
+	ss->len -= used;
+	memmove(ss->buf, ss->buf + used, ss->len);
+	return(bytes != 0);
+}
+
+static void
+stream_done(struct stream_state *ss)
+{
+	if (ss->tee_fd >= 0)
+		(void) close(ss->tee_fd);
+	free(ss->buf);
+	free(ss->ps.frames);
+}
+
+/*
+ * Work out what the lock_data entry wptr is consolidated on, the first sdepth frames
+ * after mutex_lock (*number_frames of them), with by_lock the lock, and its run,
+ * returning the hash of it.
+ */
+static unsigned long
+cons_key(struct lock_info *wptr, int sdepth, int by_lock, size_t *number_frames, unsigned long *lock)
+{
+	*number_frames = wptr->number_frames - 1;
+	if (*number_frames > (size_t) sdepth)
+		*number_frames = sdepth;
+	*lock = by_lock ? wptr->lock : 0;
+	return(hash_key((const char *) &wptr->frames[1], *number_frames * sizeof (unsigned int)) ^
+	    (*lock * 0x9e3779b97f4a7c15UL) ^ (wptr->run * 0xc2b2ae3d27d4eb4fUL));
+}
+
+/*
+ * Consolidate the number lock_data entries listed in entries (all of them, in order,
+ * if entries is NULL) into cons, returning the number of consolidated entries.  Once
+ * added up, each is given its called_from, from arena, and its averages, standard
+ * deviations and percentiles.
+ */
+static size_t
+consolidate(const size_t *entries, size_t number, struct lock_info *cons, int sdepth, int by_lock,
+    struct arena *arena)
+{
+	unsigned long lock;
+	struct lock_info *wptr;
+	struct lock_info *entry_add;
+	unsigned long hash;
+	size_t *cons_table;
+	size_t number_cons = 0;
+	size_t table_size;
+	size_t number_frames;
+	size_t count;
+	size_t slot;
+	size_t mask;
+
+	for (table_size = STACK_TABLE_MIN; table_size < number * 2; table_size *= 2)
+		;
+	cons_table = (size_t *) calloc(table_size, sizeof (size_t));
+	if (cons_table == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	mask = table_size - 1;
+
+	for (count = 0; count < number; count++) {
+		wptr = &lock_data[entries ? entries[count] : count];
+		hash = cons_key(wptr, sdepth, by_lock, &number_frames, &lock);
+		for (slot = hash & mask; cons_table[slot]; slot = (slot + 1) & mask) {
+			entry_add = &cons[cons_table[slot] - 1];
+			if (entry_add->hash == hash && entry_add->number_frames == number_frames &&
+			    entry_add->lock == lock && entry_add->run == wptr->run &&
+			    memcmp(entry_add->frames, &wptr->frames[1], number_frames * sizeof (unsigned int)) == 0)
+				break;
+		}
+		if (cons_table[slot] == 0) {
+			/* New entry */
+			entry_add = &cons[number_cons++];
+			bzero(entry_add, sizeof (struct lock_info));
+			entry_add->frames = &wptr->frames[1];
+			entry_add->number_frames = number_frames;
+			entry_add->lock = lock;
+			entry_add->run = wptr->run;
+			entry_add->hash = hash;
+			cons_table[slot] = number_cons;
+		}
+		/* Now add things up, the averages are worked out once it is all added up */
+		add_data(entry_add, wptr);
+	}
+	free(cons_table);
+
+	for (count = 0; count < number_cons; count++) {
+		cons[count].called_from = build_called_from(arena, cons[count].frames,
+		    cons[count].number_frames);
+		finish_data(cons[count].data, cons[count].total, cons[count].squares,
+		    cons[count].stddev);
+		if (cons[count].hist)
+			hist_percentiles(cons[count].hist);
+	}
+	return(number_cons);
+}
+
+/*
+ * Consolidation with -j.  The lock_data entries are split into partitions (one per
+ * thread) by the hash of what they are consolidated on, each organize thread then
+ * consolidates a partition into its own stretch of cons_data, organize_start[] on,
+ * and the stretches are closed up.  The organize threads read the main thread's
+ * lock_data and frame_data, handed over in main_tables.
+ */
+static struct parse_shard main_tables;
+static int organize_depth;
+static int organize_by_lock;
+static size_t *organize_partition;
+static size_t *organize_start;
+static size_t *organize_entries;
+static size_t *organize_count;
+
+/*
+ * Take on the tables in shard, for reading.
+ */
+static void
+load_shard(struct parse_shard *shard)
+{
+	lock_data = shard->lock_data;
+	number_lock_entries = shard->number_lock_entries;
+	frame_data = shard->frame_data;
+	number_frame_entries = shard->number_frame_entries;
+}
+
+/*
+ * Work out the partition of a thread's share of the lock_data entries.
+ */
+static void *
+partition_thread(void *arg)
+{
+	size_t thread = (uintptr_t) arg;
+	unsigned long lock;
+	size_t number_frames;
+	size_t count;
+	size_t last;
+
+	load_shard(&main_tables);
+	count = number_lock_entries * thread / parse_threads;
+	last = number_lock_entries * (thread + 1) / parse_threads;
+	for (; count < last; count++)
+		organize_partition[count] = (cons_key(&lock_data[count], organize_depth, organize_by_lock,
+		    &number_frames, &lock) >> 32) % parse_threads;
+	return(NULL);
+}
+
+/*
+ * Consolidate a partition.
+ */
+static void *
+organize_thread(void *arg)
+{
+	size_t part = (uintptr_t) arg;
+
+	load_shard(&main_tables);
+	organize_count[part] = consolidate(&organize_entries[organize_start[part]],
+	    organize_start[part + 1] - organize_start[part], &cons_data[organize_start[part]],
+	    organize_depth, organize_by_lock, &called_from_arenas[part]);
+	return(NULL);
+}
+
+/*
+ * Consolidate the data based on the first sdepth frames after mutex_lock, a stack
+ * shorter than that is consolidated on all it has.  With by_lock, the lock is part
+ * of what is matched as well.  The entries are matched by hashing that prefix of
+ * frame IDs, lock_data itself is left untouched so this can be redone at another
+ * depth.
+ */
+static void
+organize_data(int sdepth, int by_lock)
+{
+	size_t count;
+	int part;
+
+	if (sdepth < 1)
+		sdepth = 1;
+	for (count = 0; count < number_cons_entries; count++)
+		hist_free(cons_data[count].hist);
+	if (called_from_arenas == NULL) {
+		called_from_arenas = (struct arena *) calloc(parse_threads, sizeof (struct arena));
+		if (called_from_arenas == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (part = 0; part < parse_threads; part++)
+		arena_reset(&called_from_arenas[part]);
+	number_cons_entries = 0;
+	if (number_lock_entries == 0)
+		return;
+
+	/* At most one consolidated entry per stack */
+	cons_data = (struct lock_info *) realloc(cons_data, sizeof (struct lock_info) * number_lock_entries);
+	if (cons_data == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	if (parse_threads == 1) {
+		number_cons_entries = consolidate(NULL, number_lock_entries, cons_data, sdepth, by_lock,
+		    &called_from_arenas[0]);
+		return;
+	}
+
+	organize_depth = sdepth;
+	organize_by_lock = by_lock;
+	save_shard(&main_tables);
+	organize_partition = (size_t *) malloc(sizeof (size_t) * number_lock_entries);
+	organize_entries = (size_t *) malloc(sizeof (size_t) * number_lock_entries);
+	organize_start = (size_t *) calloc(parse_threads + 1, sizeof (size_t));
+	organize_count = (size_t *) calloc(parse_threads, sizeof (size_t));
+	if (organize_partition == NULL || organize_entries == NULL || organize_start == NULL ||
+	    organize_count == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	run_threads(partition_thread);
+
+	/* List the entries by partition, in their order in lock_data */
+	for (count = 0; count < number_lock_entries; count++)
+		organize_start[organize_partition[count] + 1]++;
+	for (part = 0; part < parse_threads; part++)
+		organize_start[part + 1] += organize_start[part];
+	for (count = 0; count < number_lock_entries; count++)
+		organize_entries[organize_start[organize_partition[count]]++] = count;
+	for (part = parse_threads; part > 0; part--)
+		organize_start[part] = organize_start[part - 1];
+	organize_start[0] = 0;
+
+	run_threads(organize_thread);
+
+	for (part = 0; part < parse_threads; part++) {
+		memmove(&cons_data[number_cons_entries], &cons_data[organize_start[part]],
+		    sizeof (struct lock_info) * organize_count[part]);
+		number_cons_entries += organize_count[part];
+	}
+	free(organize_partition);
+	free(organize_entries);
+	free(organize_start);
+	free(organize_count);
+}
+
+/*
+ * Return 1 if frame is the one named name.
+ */
+static int
+frame_is(unsigned int frame, const char *name)
+{
+	return(frame_data[frame].length == strlen(name) &&
+	    strncmp(frame_data[frame].name, name, frame_data[frame].length) == 0);
+}
+
+/*
+ * The comparison routines by -S option, and those in use.  Entries the primary sort
+ * finds equal are ordered by the secondary, if there is one.
+ */
+static int (*sort_routines[])(const void *, const void *) = {
+	sort_hold_count, sort_hold_max, sort_hold_avg, sort_hold_total,
+	sort_aq_count, sort_aq_max, sort_aq_average, sort_aq_spin
+};
+
+#define NUMBER_SORT_ROUTINES (sizeof (sort_routines) / sizeof (sort_routines[0]))
+
+static int (*primary_sort)(const void *, const void *);
+static int (*secondary_sort)(const void *, const void *);
+
+static void
+set_sort(int sort_option, int secondary_option)
+{
+	if (sort_option < 0 || (size_t) sort_option >= NUMBER_SORT_ROUTINES)
+		sort_option = NUMBER_SORT_ROUTINES - 1;
+	primary_sort = sort_routines[sort_option];
+	secondary_sort = NULL;
+	if (secondary_option >= 0 && (size_t) secondary_option < NUMBER_SORT_ROUTINES)
+		secondary_sort = sort_routines[secondary_option];
+}
+
+static int
+sort_entries(const void *l1_ptr, const void *l2_ptr)
+{
+	int result = primary_sort(l1_ptr, l2_ptr);
+
+	if (result == 0 && secondary_sort)
+		result = secondary_sort(l1_ptr, l2_ptr);
+	return(result);
+}
+
+static int
+sort_entry_ptrs(const void *p1_ptr, const void *p2_ptr)
+{
+	return(sort_entries(*(struct lock_info **) p1_ptr, *(struct lock_info **) p2_ptr));
+}
+
+/*
+ * Sort the number entries on sort_option (and the secondary sort), their data having
+ * been finished already.
+ */
+static void
+sort_data(struct lock_info *entries, size_t number, int sort_option)
+{
+	set_sort(sort_option, report.secondary_sort);
+	qsort(entries, number, sizeof (struct lock_info), sort_entries);
+}
+
+/*
+ * Move the heap entry at index down to its place, the heap being ordered so that the
+ * entry that sorts last is at the top.
+ */
+static void
+sift_down(struct lock_info **heap, size_t number, size_t index)
+{
+	struct lock_info *entry = heap[index];
+	size_t child;
+
+	while ((child = 2 * index + 1) < number) {
+		if (child + 1 < number && sort_entries(heap[child + 1], heap[child]) > 0)
+			child++;
+		if (sort_entries(heap[child], entry) <= 0)
+			break;
+		heap[index] = heap[child];
+		index = child;
+	}
+	heap[index] = entry;
+}
+
+/*
+ * Select the (up to) number_wanted entries that sort first on sort_option, of those
+ * called from caller if it is not NULL, into selected in their sorted order.  A heap of
+ * the best number_wanted seen so far is kept, the top being the worst of them, so this
+ * is O(number log number_wanted) rather than sorting all of them.  Returns how many
+ * were selected.
+ */
+static size_t
+select_data(struct lock_info *entries, size_t number, char *caller, int sort_option,
+    struct lock_info **selected, size_t number_wanted)
+{
+	struct lock_info *entry;
+	size_t number_selected = 0;
+	size_t count;
+	size_t index;
+
+	set_sort(sort_option, report.secondary_sort);
+	if (number_wanted == 0)
+		return(0);
+	for (count = 0; count < number; count++) {
+		entry = &entries[count];
+		if (caller != NULL && !frame_is(entry->frames[0], caller))
+			continue;
+		if (number_selected < number_wanted) {
+			selected[number_selected++] = entry;
+			if (number_selected == number_wanted) {
+				for (index = number_wanted / 2; index-- > 0; )
+					sift_down(selected, number_wanted, index);
+			}
+		} else if (sort_entries(entry, selected[0]) < 0) {
+			selected[0] = entry;
+			sift_down(selected, number_wanted, 0);
+		}
+	}
+	qsort(selected, number_selected, sizeof (struct lock_info *), sort_entry_ptrs);
+	return(number_selected);
+}
+
+/*
+ * Finish off a title line, with the titles of the standard deviation columns when
+ * there are sums of squares, of the percentile columns when there are histograms, of
+ * the error column with a stack budget (-m) and of the Run column with -R.
+ */
+static void
+dump_extra_titles(FILE *fd)
+{
+	char title[32];
+	int which;
+	int pct;
+
+	for (which = TIME_HOLD; which >= TIME_ACQ; which--) {
+		if (squares_data)
+			fprintf(fd, "%15s", which == TIME_HOLD ? "Hold SD (ns)" : "ACQs SD (ns)");
+		for (pct = 0; hist_data && pct < NUMBER_PERCENTILES; pct++) {
+			(void) snprintf(title, sizeof (title), "%s %s", which == TIME_HOLD ? "Hold" : "ACQs",
+			    percentile_titles[pct]);
+			fprintf(fd, "%15s", title);
+		}
+	}
+	if (hh_budget || hh_folded)
+		fprintf(fd, "%15s", "ACQs Err (ns)");
+	if (run_names)
+		fprintf(fd, "  %s", "Run");
+	fprintf(fd, "\n");
+}
+
+/*
+ * Finish off a line of data, with the standard deviations and percentiles to match
+ * dump_extra_titles().  An entry without a histogram of its own has the percentiles
+ * left blank.
+ */
+static void
+dump_extra_columns(FILE *fd, struct lock_info *entry)
+{
+	int which;
+	int pct;
+
+	for (which = TIME_HOLD; which >= TIME_ACQ; which--) {
+		if (squares_data)
+			fprintf(fd, "%15ld", entry->stddev[which]);
+		for (pct = 0; hist_data && pct < NUMBER_PERCENTILES; pct++) {
+			if (entry->hist && entry->hist->number[which])
+				fprintf(fd, "%15ld", entry->hist->percentiles[which][pct]);
+			else
+				fprintf(fd, "%15s", "");
+		}
+	}
+	if (hh_budget || hh_folded)
+		fprintf(fd, "%15ld", sum_to_long(entry->error));
+	if (run_names)
+		fprintf(fd, "  %s", run_names[entry->run]);
+	fprintf(fd, "\n");
+}
+
+/*
+ * Print a consolidated entry, the first frame of called_from along with the data, then
+ * the rest of the frames one to a line.  Nothing is printed if caller is not NULL and
+ * the entry was not called from it.
+ */
+static void
+dump_entry(FILE *fd, struct lock_info *entry, char *caller)
+{
+	char *ptr, *ptr1, *ptr2;
+
+	if (entry->called_from == NULL)
+		return;
+	ptr = strchr(entry->called_from, ':');
+	if (ptr)
+		ptr[0] = '\0';
+	if (caller != NULL) {
+		ptr1 = entry->called_from;
+		while(isspace(ptr1[0]))
+		       ptr1++;
+		ptr2 = ptr1 + strcspn(ptr1, " ");
+		if (strlen(caller) != (size_t) (ptr2 - ptr1) ||
+		    strncmp(ptr1, caller, ptr2 - ptr1))
+			return;
+	}
+	fprintf(fd, "%48s%15ld%15ld%15ld%15ld%15ld%15ld", entry->called_from,
+	   entry->data[HD_DATA_HOLD_COUNT], entry->data[HD_DATA_HOLD_MAX],
+	      entry->data[HD_DATA_HOLD_AVG],
+	   entry->data[ACQ_DATA_HOLD_COUNT], entry->data[ACQ_DATA_HOLD_MAX],
+	      entry->data[ACQ_DATA_HOLD_AVG]);
+	dump_extra_columns(fd, entry);
+	if (ptr) {
+		ptr = &ptr[1];
+		while(ptr[0] != '\0') {
+			ptr1 = strchr(ptr, ':');
+			if(ptr1)
+				ptr1[0] = '\0';
+			fprintf(fd, "%48s\n", ptr);
+			ptr = ptr1;
+			if (ptr)
+				ptr++;
+		}
+	}
+}
+
+/*
+ * Title of the # holds (holds set) or # ACQs column, marked as an estimate when the
+ * data was sampled.
+ */
+static const char *
+count_title(int holds)
+{
+	if (sample_rate > 1)
+		return(holds ? "# holds (est)" : "# ACQs (est)");
+	return(holds ? "# holds" : "# ACQs");
+}
+
+/*
+ * Report how the data was sampled, and the totals of every acquisition and hold
+ * which are exact whatever the sampling.
+ */
+static void
+dump_sampling(FILE *fd)
+{
+	if (sample_rate == 1 && sample_threshold == 0)
+		return;
+	if (sample_rate > 1)
+		fprintf(fd, "Stacks sampled 1 in %ld, the counts by stack are estimates (scaled by %ld)\n",
+		    sample_rate, sample_rate);
+	if (sample_threshold)
+		fprintf(fd, "Only acquisitions and holds of at least %ld ns are broken out by stack\n",
+		    sample_threshold);
+	finish_data(totals, total_times, NULL, NULL);
+	fprintf(fd, "All acquisitions: count %ld, average %ld ns, total %ld ns\n",
+	    totals[ACQ_DATA_HOLD_COUNT], totals[ACQ_DATA_HOLD_AVG], totals[ACQ_DATA_TOTAL_TIME]);
+	if (totals[HD_DATA_HOLD_COUNT])
+		fprintf(fd, "All holds: count %ld, average %ld ns, total %ld ns\n",
+		    totals[HD_DATA_HOLD_COUNT], totals[HD_DATA_HOLD_AVG], totals[HD_DATA_TOTAL_TIME]);
+}
+
+/*
+ * Report how many stacks did not fit in the stack budget (-m).
+ */
+static void
+dump_budget(FILE *fd)
+{
+	if (hh_folded && hh_budget)
+		fprintf(fd, "Stack budget of %zu used up, %zu stacks folded into [other]\n",
+		    hh_budget, hh_folded);
+	else if (hh_folded)
+		fprintf(fd, "%zu stacks folded into [other] by the stack budgets of the captures\n",
+		    hh_folded);
+}
+
+/*
+ * Dump the lock information.  With a stack budget, what did not fit is reported last
+ * as [other], unless just the stacks called from caller are wanted.
+ */
+static void
+dump_data(FILE *fd, char *caller, int sort_option, int numb_to_show)
+{
+	char other_name[] = "[other]";
+	struct lock_info **selected;
+	size_t count;
+	size_t number_shown = number_cons_entries;
+
+	if (numb_to_show >= 0 && (size_t) numb_to_show < number_shown)
+		number_shown = numb_to_show;
+	selected = (struct lock_info **) malloc(sizeof (struct lock_info *) * (number_shown + 1));
+	if (selected == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	number_shown = select_data(cons_data, number_cons_entries, caller, sort_option, selected,
+	    number_shown);
+
+	fprintf(fd, "%48s%15s%15s%15s%15s%15s%15s",
+	   "caller", count_title(1), "Hold Max (ns)", "Hold Avg (ns)", count_title(0), "ACQs Max (ns)",
+	   "ACQs Avg (ns)");
+	dump_extra_titles(fd);
+	for (count = 0; count < number_shown; count++)
+		dump_entry(fd, selected[count], caller);
+	free(selected);
+
+	if ((hh_budget || hh_folded) && caller == NULL &&
+	    (other_data.data[ACQ_DATA_HOLD_COUNT] || other_data.data[HD_DATA_HOLD_COUNT])) {
+		finish_data(other_data.data, other_data.total, other_data.squares, other_data.stddev);
+		if (other_data.hist)
+			hist_percentiles(other_data.hist);
+		other_data.called_from = other_name;
+		dump_entry(fd, &other_data, NULL);
+		other_data.called_from = NULL;
+	}
+}
+
+/*
+ * Name a lock, a static lock is named by the data symbol it lies in, a dynamically
+ * allocated one by its address.
+ */
+static void
+lock_name(unsigned long lock, char *buffer, size_t size)
+{
+	struct ksym *sym;
+
+	(void) pthread_once(&ksyms_once, load_kallsyms);
+	sym = find_ksym(dsyms, number_dsyms, lock);
+	if (sym && lock - sym->address < LOCK_SYMBOL_RANGE)
+		(void) snprintf(buffer, size, "%s+%lu", sym->name, lock - sym->address);
+	else
+		(void) snprintf(buffer, size, "0x%lx", lock);
+}
+
+/*
+ * Dump the lock information by lock, the locks sorted on sort_option, each followed
+ * by the call sites that took it (consolidated with organize_data(sdepth, 1)).  The
+ * numb_to_show hottest locks are shown, and up to as many call sites for each.
+ */
+static void
+dump_locks(FILE *fd, char *caller, int sort_option, int numb_to_show)
+{
+	struct lock_info *locks;
+	struct lock_info *lptr;
+	struct lock_info *entry;
+	struct lock_info **by_lock;
+	size_t *lock_table;
+	size_t *first;
+	size_t number_locks = 0;
+	size_t table_size;
+	size_t count;
+	size_t index;
+	size_t slot;
+	size_t mask;
+	size_t last;
+	char name[600];
+
+	fprintf(fd, "%-48s%15s%15s%15s%15s%15s%15s",
+	   "lock / caller", count_title(1), "Hold Max (ns)", "Hold Avg (ns)", count_title(0), "ACQs Max (ns)",
+	   "ACQs Avg (ns)");
+	dump_extra_titles(fd);
+	if (number_cons_entries == 0)
+		return;
+
+	sort_data(cons_data, number_cons_entries, sort_option);
+	for (table_size = STACK_TABLE_MIN; table_size < number_cons_entries * 2; table_size *= 2)
+		;
+	mask = table_size - 1;
+	locks = (struct lock_info *) calloc(number_cons_entries, sizeof (struct lock_info));
+	lock_table = (size_t *) calloc(table_size, sizeof (size_t));
+	by_lock = (struct lock_info **) malloc(sizeof (struct lock_info *) * number_cons_entries);
+	first = (size_t *) calloc(number_cons_entries + 1, sizeof (size_t));
+	if (locks == NULL || lock_table == NULL || by_lock == NULL || first == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Total up each lock over its call sites */
+	for (count = 0; count < number_cons_entries; count++) {
+		entry = &cons_data[count];
+		if (caller != NULL && !frame_is(entry->frames[0], caller))
+			continue;
+		for (slot = (entry->lock * 0x9e3779b97f4a7c15UL >> 20) & mask; lock_table[slot];
+		    slot = (slot + 1) & mask) {
+			if (locks[lock_table[slot] - 1].lock == entry->lock)
+				break;
+		}
+		if (lock_table[slot] == 0) {
+			locks[number_locks].lock = entry->lock;
+			lock_table[slot] = ++number_locks;
+		}
+		add_data(&locks[lock_table[slot] - 1], entry);
+	}
+	for (count = 0; count < number_locks; count++) {
+		lptr = &locks[count];
+		if (lptr->hist)
+			hist_percentiles(lptr->hist);
+		finish_data(lptr->data, lptr->total, lptr->squares, lptr->stddev);
+	}
+	sort_data(locks, number_locks, sort_option);
+
+	/*
+	 * Group the call sites by lock, in the order the locks now sort in, keeping the
+	 * call sites of each lock in their sorted order.
+	 */
+	bzero(lock_table, sizeof (size_t) * table_size);
+	for (count = 0; count < number_locks; count++) {
+		slot = (locks[count].lock * 0x9e3779b97f4a7c15UL >> 20) & mask;
+		while (lock_table[slot])
+			slot = (slot + 1) & mask;
+		lock_table[slot] = count + 1;
+	}
+	for (count = 0; count < number_cons_entries; count++) {
+		entry = &cons_data[count];
+		if (caller != NULL && !frame_is(entry->frames[0], caller))
+			continue;
+		for (slot = (entry->lock * 0x9e3779b97f4a7c15UL >> 20) & mask; lock_table[slot];
+		    slot = (slot + 1) & mask) {
+			if (locks[lock_table[slot] - 1].lock == entry->lock)
+				break;
+		}
+		if (lock_table[slot])
+			first[lock_table[slot]]++;
+	}
+	for (count = 1; count <= number_locks; count++)
+		first[count] += first[count - 1];
+	for (count = 0; count < number_cons_entries; count++) {
+		entry = &cons_data[count];
+		if (caller != NULL && !frame_is(entry->frames[0], caller))
+			continue;
+		for (slot = (entry->lock * 0x9e3779b97f4a7c15UL >> 20) & mask; lock_table[slot];
+		    slot = (slot + 1) & mask) {
+			if (locks[lock_table[slot] - 1].lock == entry->lock)
+				break;
+		}
+		if (lock_table[slot])
+			by_lock[first[lock_table[slot] - 1]++] = entry;
+	}
+
+	/* first[lock] is now the end of the call sites of the lock */
+	for (count = 0; count < number_locks && count < (size_t) numb_to_show; count++) {
+		lptr = &locks[count];
+		lock_name(lptr->lock, name, sizeof (name));
+		fprintf(fd, "\n%-48s%15ld%15ld%15ld%15ld%15ld%15ld", name,
+		   lptr->data[HD_DATA_HOLD_COUNT], lptr->data[HD_DATA_HOLD_MAX],
+		      lptr->data[HD_DATA_HOLD_AVG],
+		   lptr->data[ACQ_DATA_HOLD_COUNT], lptr->data[ACQ_DATA_HOLD_MAX],
+		      lptr->data[ACQ_DATA_HOLD_AVG]);
+		dump_extra_columns(fd, lptr);
+		index = count ? first[count - 1] : 0;
+		last = first[count];
+		if (last - index > (size_t) numb_to_show)
+			last = index + numb_to_show;
+		for (; index < last; index++)
+			dump_entry(fd, by_lock[index], caller);
+	}
+	for (count = 0; count < number_locks; count++)
+		hist_free(locks[count].hist);
+	free(locks);
+	free(lock_table);
+	free(by_lock);
+	free(first);
+}
+
+/*
+ * Differential report (-D), the captures given with -D being the baseline and those
+ * with -f the candidate.  Both are reduced into the one table, the baseline stacks as
+ * run DIFF_BASELINE and the candidate's as run DIFF_CANDIDATE, so they share the frame
+ * IDs and consolidate at the same depth without being added together.  The call sites
+ * are then joined on what they were consolidated on (called_from, and the lock with
+ * -l), by a hash table of the baseline's, and ranked on the change in the total time
+ * or in the tail latency (p99 with -H, the maximum otherwise) chosen with -S.  A call
+ * site only in the candidate is new, one only in the baseline is gone.
+ */
+#define TAIL_PERCENTILE 2
+
+struct lock_diff {
+	struct lock_info *base;
+	struct lock_info *cand;
+	lock_sum change[2];
+	long tail_change[2];
+};
+
+static int diff_which;
+static int diff_tail;
+
+/*
+ * Tail latency of the which times of entry, 0 if there is no entry.
+ */
+static long
+tail_latency(struct lock_info *entry, int which)
+{
+	if (entry == NULL)
+		return(0);
+	if (hist_data)
+		return(entry->hist && entry->hist->number[which] ?
+		    entry->hist->percentiles[which][TAIL_PERCENTILE] : 0);
+	return(entry->data[DATA_INDEX(which, ACQ_DATA_HOLD_MAX)]);
+}
+
+/*
+ * Hash of what the consolidated entry was consolidated on, less its run.
+ */
+static unsigned long
+join_key(struct lock_info *entry)
+{
+	return(hash_key((const char *) entry->frames, entry->number_frames * sizeof (unsigned int)) ^
+	    (entry->lock * 0x9e3779b97f4a7c15UL));
+}
+
+/*
+ * Sort the call sites on the change ranked on, the largest increase first, then on the
+ * candidate's total acquire time.
+ */
+static int
+sort_diffs(const void *d1_ptr, const void *d2_ptr)
+{
+	struct lock_diff *d1 = (struct lock_diff *) d1_ptr;
+	struct lock_diff *d2 = (struct lock_diff *) d2_ptr;
+	lock_sum change1 = diff_tail ? d1->tail_change[diff_which] : d1->change[diff_which];
+	lock_sum change2 = diff_tail ? d2->tail_change[diff_which] : d2->change[diff_which];
+	lock_sum total1 = d1->cand ? d1->cand->total[TIME_ACQ] : 0;
+	lock_sum total2 = d2->cand ? d2->cand->total[TIME_ACQ] : 0;
+
+	if (change1 != change2)
+		return(change1 < change2 ? 1 : -1);
+	if (total1 != total2)
+		return(total1 < total2 ? 1 : -1);
+	return(0);
+}
+
+/*
+ * sift_down() for the heap of call sites of the differential report.
+ */
+static void
+sift_down_diff(struct lock_diff *heap, size_t number, size_t index)
+{
+	struct lock_diff entry = heap[index];
+	size_t child;
+
+	while ((child = 2 * index + 1) < number) {
+		if (child + 1 < number && sort_diffs(&heap[child + 1], &heap[child]) > 0)
+			child++;
+		if (sort_diffs(&heap[child], &entry) <= 0)
+			break;
+		heap[index] = heap[child];
+		index = child;
+	}
+	heap[index] = entry;
+}
+
+/*
+ * Print a call site of the differential report, the first frame along with the data,
+ * then the rest of the frames one to a line.
+ */
+static void
+dump_diff_entry(FILE *fd, struct lock_diff *diff)
+{
+	struct lock_info *entry = diff->cand ? diff->cand : diff->base;
+	const char *ptr = entry->called_from;
+	size_t length = strcspn(ptr, ":");
+
+	fprintf(fd, "%48.*s%15ld%15ld%15ld%15ld%15ld%15ld%15ld%15ld%15ld%15ld",
+	    (int) length, ptr,
+	    diff->base ? diff->base->data[ACQ_DATA_HOLD_COUNT] : 0,
+	    diff->cand ? diff->cand->data[ACQ_DATA_HOLD_COUNT] : 0,
+	    diff->base ? diff->base->data[ACQ_DATA_TOTAL_TIME] : 0,
+	    diff->cand ? diff->cand->data[ACQ_DATA_TOTAL_TIME] : 0,
+	    sum_to_long(diff->change[TIME_ACQ]), sum_to_long(diff->change[TIME_HOLD]),
+	    tail_latency(diff->base, TIME_ACQ), tail_latency(diff->cand, TIME_ACQ),
+	    diff->tail_change[TIME_ACQ], diff->tail_change[TIME_HOLD]);
+	if (diff->base == NULL)
+		fprintf(fd, "  new");
+	else if (diff->cand == NULL)
+		fprintf(fd, "  gone");
+	fprintf(fd, "\n");
+	for (ptr += length; *ptr == ':' && ptr[1] != '\0'; ptr += length) {
+		ptr++;
+		length = strcspn(ptr, ":");
+		fprintf(fd, "%48.*s\n", (int) length, ptr);
+	}
+}
+
+/*
+ * Dump the differential report, see above, of the numb_to_show call sites that changed
+ * the most for the worse (on sort_option) and of those called from caller if not NULL.
+ */
+static void
+dump_diff(FILE *fd, char *caller, int sort_option, int numb_to_show)
+{
+	struct lock_diff *diffs;
+	struct lock_diff *diff;
+	struct lock_info *entry;
+	struct lock_info *base;
+	lock_sum changes[2] = { 0, 0 };
+	unsigned char *matched;
+	unsigned long hash;
+	size_t *join_table;
+	size_t number_diffs = 0;
+	size_t number_shown;
+	size_t number_base = 0;
+	size_t number_new = 0;
+	size_t number_gone = 0;
+	size_t table_size;
+	size_t count;
+	size_t slot;
+	size_t mask;
+	int which;
+
+	/* Hold options (0 to 3) rank on the hold times, the Max options on the tail */
+	diff_which = (sort_option >= HOLDS && sort_option <= HOLDS_SPENT) ? TIME_HOLD : TIME_ACQ;
+	diff_tail = (sort_option == HOLDS_MAX || sort_option == ACQS_MAX);
+
+	for (count = 0; count < number_cons_entries; count++)
+		if (cons_data[count].run == DIFF_BASELINE)
+			number_base++;
+	for (table_size = STACK_TABLE_MIN; table_size < number_base * 2; table_size *= 2)
+		;
+	join_table = (size_t *) calloc(table_size, sizeof (size_t));
+	matched = (unsigned char *) calloc(number_cons_entries + 1, 1);
+	diffs = (struct lock_diff *) malloc(sizeof (struct lock_diff) * (number_cons_entries + 1));
+	if (join_table == NULL || matched == NULL || diffs == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	mask = table_size - 1;
+
+	/* Build on the baseline */
+	for (count = 0; count < number_cons_entries; count++) {
+		if (cons_data[count].run != DIFF_BASELINE)
+			continue;
+		for (slot = join_key(&cons_data[count]) & mask; join_table[slot]; slot = (slot + 1) & mask)
+			;
+		join_table[slot] = count + 1;
+	}
+
+	/* Probe with the candidate */
+	for (count = 0; count < number_cons_entries; count++) {
+		entry = &cons_data[count];
+		if (entry->run != DIFF_CANDIDATE || (caller != NULL && !frame_is(entry->frames[0], caller)))
+			continue;
+		hash = join_key(entry);
+		base = NULL;
+		for (slot = hash & mask; join_table[slot]; slot = (slot + 1) & mask) {
+			base = &cons_data[join_table[slot] - 1];
+			if (base->number_frames == entry->number_frames && base->lock == entry->lock &&
+			    memcmp(base->frames, entry->frames, entry->number_frames * sizeof (unsigned int)) == 0)
+				break;
+			base = NULL;
+		}
+		diff = &diffs[number_diffs++];
+		diff->base = base;
+		diff->cand = entry;
+		if (base)
+			matched[base - cons_data] = 1;
+		else
+			number_new++;
+	}
+
+	/* What is left of the baseline is gone */
+	for (count = 0; count < number_cons_entries; count++) {
+		if (cons_data[count].run != DIFF_BASELINE || matched[count] ||
+		    (caller != NULL && !frame_is(cons_data[count].frames[0], caller)))
+			continue;
+		diff = &diffs[number_diffs++];
+		diff->base = &cons_data[count];
+		diff->cand = NULL;
+		number_gone++;
+	}
+
+	for (count = 0; count < number_diffs; count++) {
+		diff = &diffs[count];
+		for (which = TIME_ACQ; which <= TIME_HOLD; which++) {
+			diff->change[which] = (diff->cand ? diff->cand->total[which] : 0) -
+			    (diff->base ? diff->base->total[which] : 0);
+			diff->tail_change[which] = tail_latency(diff->cand, which) -
+			    tail_latency(diff->base, which);
+			changes[which] += diff->change[which];
+		}
+	}
+	/* Only the call sites shown are sorted, picked out with a heap as select_data() does */
+	number_shown = number_diffs;
+	if (numb_to_show >= 0 && (size_t) numb_to_show < number_shown)
+		number_shown = numb_to_show;
+	if (number_shown && number_shown < number_diffs) {
+		for (count = number_shown / 2; count-- > 0; )
+			sift_down_diff(diffs, number_shown, count);
+		for (count = number_shown; count < number_diffs; count++) {
+			if (sort_diffs(&diffs[count], &diffs[0]) < 0) {
+				diffs[0] = diffs[count];
+				sift_down_diff(diffs, number_shown, 0);
+			}
+		}
+	}
+	qsort(diffs, number_shown, sizeof (struct lock_diff), sort_diffs);
+
+	fprintf(fd, "Call sites: %zu in the candidate, %zu new, %zu gone\n",
+	    number_diffs - number_gone, number_new, number_gone);
+	fprintf(fd, "Change in total acquire time %ld ns, in total hold time %ld ns\n",
+	    sum_to_long(changes[TIME_ACQ]), sum_to_long(changes[TIME_HOLD]));
+	fprintf(fd, "%48s%15s%15s%15s%15s%15s%15s%15s%15s%15s%15s\n", "caller",
+	    "Base # ACQs", count_title(0), "Base ACQs Tot", "ACQs Tot (ns)", "ACQs Tot Diff",
+	    "Hold Tot Diff", hist_data ? "Base ACQs p99" : "Base ACQs Max",
+	    hist_data ? "ACQs p99 (ns)" : "ACQs Max (ns)", hist_data ? "ACQs p99 Diff" : "ACQs Max Diff",
+	    hist_data ? "Hold p99 Diff" : "Hold Max Diff");
+	for (count = 0; count < number_shown; count++)
+		dump_diff_entry(fd, &diffs[count]);
+	free(join_table);
+	free(matched);
+	free(diffs);
+}
+
+/*
+ * Machine readable output (-F): the consolidated entries as CSV, JSON lines or folded
+ * stacks.  Everything goes through out_buffer, formatted here rather than by stdio, so
+ * that writing out millions of rows allocates nothing and costs one write per
+ * OUTPUT_BUFFER bytes.
+ */
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 1
+#define FORMAT_JSON 2
+#define FORMAT_FOLDED 3
+
+#define OUTPUT_BUFFER (64 * 1024)
+
+static const char *format_names[] = { "text", "csv", "json", "folded" };
+
+#define NUMBER_FORMATS (sizeof (format_names) / sizeof (format_names[0]))
+
+struct output_buffer {
 	FILE *fd;
-	char buffer[8192];
+	size_t used;
+	int header_done;
+	char data[OUTPUT_BUFFER];
+};
 
-	fd = fopen(BPFTRACE, "w");
+static struct output_buffer out_buffer;
+
+static void
+out_flush()
+{
+	if (out_buffer.used && fwrite(out_buffer.data, 1, out_buffer.used, out_buffer.fd) !=
+	    out_buffer.used) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+	out_buffer.used = 0;
+}
+
+static void
+out_bytes(const char *bytes, size_t length)
+{
+	if (out_buffer.used + length > OUTPUT_BUFFER) {
+		out_flush();
+		if (length > OUTPUT_BUFFER) {
+			if (fwrite(bytes, 1, length, out_buffer.fd) != length) {
+				perror("write");
+				exit(EXIT_FAILURE);
+			}
+			return;
+		}
+	}
+	memcpy(&out_buffer.data[out_buffer.used], bytes, length);
+	out_buffer.used += length;
+}
+
+static void
+out_char(char value)
+{
+	if (out_buffer.used == OUTPUT_BUFFER)
+		out_flush();
+	out_buffer.data[out_buffer.used++] = value;
+}
+
+static void
+out_string(const char *string)
+{
+	out_bytes(string, strlen(string));
+}
+
+static void
+out_long(long value)
+{
+	char digits[24];
+	size_t ptr = sizeof (digits);
+	unsigned long uvalue = value < 0 ? - (unsigned long) value : (unsigned long) value;
+
+	do {
+		digits[--ptr] = '0' + uvalue % 10;
+		uvalue /= 10;
+	} while (uvalue);
+	if (value < 0)
+		digits[--ptr] = '-';
+	out_bytes(&digits[ptr], sizeof (digits) - ptr);
+}
+
+/*
+ * Return 1 if character has to be escaped in a JSON string, or (csv set) means a CSV
+ * field has to be quoted.
+ */
+static int
+out_special(char character, int csv)
+{
+	if (character == '"')
+		return(1);
+	if (csv)
+		return(character == ',' || character == '\r' || character == '\n');
+	return(character == '\\' || (unsigned char) character < 0x20);
+}
+
+/*
+ * Write string (length bytes of it) as a CSV field or a JSON string, the runs of
+ * characters needing nothing done copied in one go.  A CSV field is only quoted when
+ * it has to be, the quotes in it doubled.
+ */
+static void
+out_quoted(const char *string, size_t length, int format)
+{
+	static const char hex[] = "0123456789abcdef";
+	int csv = format == FORMAT_CSV;
+	size_t start;
+	size_t count;
+
+	for (count = 0; count < length && !out_special(string[count], csv); count++)
+		;
+	if (csv && count == length) {
+		out_bytes(string, length);
+		return;
+	}
+	out_char('"');
+	start = 0;
+	for (; count < length; count++) {
+		if (!out_special(string[count], csv))
+			continue;
+		out_bytes(&string[start], count - start);
+		start = count + 1;
+		if (csv) {
+			/* Only the quotes need doing in a quoted field */
+			if (string[count] == '"')
+				out_string("\"\"");
+			else
+				out_char(string[count]);
+		} else if (string[count] == '"' || string[count] == '\\') {
+			out_char('\\');
+			out_char(string[count]);
+		} else {
+			out_string("\\u00");
+			out_char(hex[(unsigned char) string[count] >> 4]);
+			out_char(hex[string[count] & 0xf]);
+		}
+	}
+	out_bytes(&string[start], length - start);
+	out_char('"');
+}
+
+/*
+ * Start field name (prefix followed by name) of a row: for CSV the title in the
+ * header, for JSON the key.
+ */
+static void
+out_field(int format, int header, const char *prefix, const char *name)
+{
+	if (format == FORMAT_JSON) {
+		out_string(",\"");
+		out_string(prefix);
+		out_string(name);
+		out_string("\":");
+	} else {
+		out_char(',');
+		if (header) {
+			out_string(prefix);
+			out_string(name);
+		}
+	}
+}
+
+/*
+ * Write a named value, or the CSV title of it when header is set.
+ */
+static void
+out_value(int format, int header, const char *prefix, const char *name, long value)
+{
+	out_field(format, header, prefix, name);
+	if (!header)
+		out_long(value);
+}
+
+/*
+ * Write a CSV or JSON row for entry, consolidated at depth, or the CSV header if entry
+ * is NULL.  The stack is from the caller out, as in the text report.  An entry without
+ * frames is the [other] row of -m.
+ */
+static void
+dump_format_entry(int format, struct lock_info *entry, int depth)
+{
+	static const char *prefixes[2] = { "acq_", "hold_" };
+	int header = entry == NULL;
+	char name[600];
+	size_t count;
+	int which;
+	int pct;
+
+	if (format == FORMAT_JSON) {
+		out_string("{\"depth\":");
+		out_long(depth);
+		out_string(",\"caller\":");
+	} else if (header)
+		out_string("depth,caller");
+	else {
+		out_long(depth);
+		out_char(',');
+	}
+	if (!header) {
+		if (entry->number_frames)
+			out_quoted(frame_data[entry->frames[0]].name,
+			    frame_data[entry->frames[0]].length, format);
+		else
+			out_quoted("[other]", 7, format);
+	}
+
+	out_field(format, header, "", "stack");
+	if (format == FORMAT_JSON)
+		out_char('[');
+	else if (!header)
+		out_char('"');
+	for (count = 0; !header && count < entry->number_frames; count++) {
+		if (count)
+			out_char(format == FORMAT_JSON ? ',' : ';');
+		/* Frame names have no ';' or '"' in them, only JSON needs them quoted */
+		if (format == FORMAT_JSON)
+			out_quoted(frame_data[entry->frames[count]].name,
+			    frame_data[entry->frames[count]].length, format);
+		else
+			out_bytes(frame_data[entry->frames[count]].name,
+			    frame_data[entry->frames[count]].length);
+	}
+	if (format == FORMAT_JSON)
+		out_char(']');
+	else if (!header)
+		out_char('"');
+
+	if (report.locks) {
+		out_field(format, header, "", "lock");
+		if (!header) {
+			if (entry->number_frames)
+				lock_name(entry->lock, name, sizeof (name));
+			else
+				name[0] = '\0';
+			out_quoted(name, strlen(name), format);
+		}
+	}
+	if (run_names) {
+		out_field(format, header, "", "run");
+		if (!header)
+			out_quoted(run_names[entry->run], strlen(run_names[entry->run]), format);
+	}
+	if (trace.interval)
+		out_value(format, header, "", "interval", report.intervals);
+
+	for (which = TIME_HOLD; which >= TIME_ACQ; which--) {
+		out_value(format, header, prefixes[which], "count",
+		    header ? 0 : entry->data[DATA_INDEX(which, ACQ_DATA_HOLD_COUNT)]);
+		out_value(format, header, prefixes[which], "max",
+		    header ? 0 : entry->data[DATA_INDEX(which, ACQ_DATA_HOLD_MAX)]);
+		out_value(format, header, prefixes[which], "avg",
+		    header ? 0 : entry->data[DATA_INDEX(which, ACQ_DATA_HOLD_AVG)]);
+		out_value(format, header, prefixes[which], "total",
+		    header ? 0 : entry->data[DATA_INDEX(which, ACQ_DATA_TOTAL_TIME)]);
+		if (squares_data)
+			out_value(format, header, prefixes[which], "sd",
+			    header ? 0 : entry->stddev[which]);
+		for (pct = 0; hist_data && pct < NUMBER_PERCENTILES; pct++) {
+			/* No histogram of its own, the percentile is left empty (null) */
+			if (header || (entry->hist && entry->hist->number[which]))
+				out_value(format, header, prefixes[which], percentile_titles[pct],
+				    header ? 0 : entry->hist->percentiles[which][pct]);
+			else {
+				out_field(format, header, prefixes[which], percentile_titles[pct]);
+				if (format == FORMAT_JSON)
+					out_string("null");
+			}
+		}
+	}
+	if (hh_budget || hh_folded)
+		out_value(format, header, "acq_", "err", header ? 0 : sum_to_long(entry->error));
+	if (format == FORMAT_JSON)
+		out_char('}');
+	out_char('\n');
+}
+
+/*
+ * Write entry as a folded stack, its frames from the outermost in separated by ';',
+ * followed by the time spent there.  An entry without frames is [other].
+ */
+static void
+dump_folded_entry(struct lock_info *entry, int which)
+{
+	size_t count;
+	long weight = entry->data[DATA_INDEX(which, ACQ_DATA_TOTAL_TIME)];
+
+	if (weight == 0)
+		return;
+	if (entry->number_frames == 0)
+		out_string("[other]");
+	for (count = entry->number_frames; count > 0; count--) {
+		out_bytes(frame_data[entry->frames[count - 1]].name,
+		    frame_data[entry->frames[count - 1]].length);
+		if (count > 1)
+			out_char(';');
+	}
+	out_char(' ');
+	out_long(weight);
+	out_char('\n');
+}
+
+/*
+ * Write the consolidated entries, those of caller if it is not NULL, in format: the
+ * numb_to_show that sort first on sort_option followed by [other] as dump_data() does.
+ * CSV has its header written before the first row of the run.  Folded stacks are
+ * weighted by the hold time if sorting on a hold field, otherwise the acquire time.
+ */
+static void
+dump_format(FILE *fd, int format, char *caller, int sort_option, int numb_to_show, int depth)
+{
+	struct lock_info **selected;
+	size_t count;
+	size_t number_shown = number_cons_entries;
+	int which = (sort_option >= HOLDS && sort_option <= HOLDS_SPENT) ? TIME_HOLD : TIME_ACQ;
+
+	out_buffer.fd = fd;
+	if (numb_to_show >= 0 && (size_t) numb_to_show < number_shown)
+		number_shown = numb_to_show;
+	selected = (struct lock_info **) malloc(sizeof (struct lock_info *) * (number_shown + 1));
+	if (selected == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	number_shown = select_data(cons_data, number_cons_entries, caller, sort_option, selected,
+	    number_shown);
+
+	if (format == FORMAT_CSV && !out_buffer.header_done) {
+		dump_format_entry(format, NULL, depth);
+		out_buffer.header_done = 1;
+	}
+	for (count = 0; count < number_shown; count++) {
+		if (format == FORMAT_FOLDED)
+			dump_folded_entry(selected[count], which);
+		else
+			dump_format_entry(format, selected[count], depth);
+	}
+	free(selected);
+
+	if ((hh_budget || hh_folded) && caller == NULL &&
+	    (other_data.data[ACQ_DATA_HOLD_COUNT] || other_data.data[HD_DATA_HOLD_COUNT])) {
+		finish_data(other_data.data, other_data.total, other_data.squares, other_data.stddev);
+		if (other_data.hist)
+			hist_percentiles(other_data.hist);
+		if (format == FORMAT_FOLDED)
+			dump_folded_entry(&other_data, which);
+		else
+			dump_format_entry(format, &other_data, depth);
+	}
+	out_flush();
+}
+
+/*
+ * Double the size of the call tree hash table, and reinsert every node but the root.
+ */
+static void
+grow_tree_table()
+{
+	size_t count;
+	size_t slot;
+	size_t mask;
+
+	free(tree_table);
+	if (tree_table_size == 0)
+		tree_table_size = STACK_TABLE_MIN;
+	else
+		tree_table_size *= 2;
+	tree_table = (size_t *) calloc(tree_table_size, sizeof (size_t));
+	if (tree_table == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	mask = tree_table_size - 1;
+	for (count = 1; count < number_tree_nodes; count++) {
+		slot = tree_data[count].hash & mask;
+		while (tree_table[slot])
+			slot = (slot + 1) & mask;
+		tree_table[slot] = count + 1;
+	}
+}
+
+/*
+ * Add a (zeroed) node to the call tree, returning its index.
+ */
+static size_t
+new_tree_node(unsigned int frame, size_t parent, unsigned long hash)
+{
+	struct tree_node *node;
+
+	if (number_tree_nodes == tree_data_size) {
+		tree_data_size = tree_data_size ? tree_data_size * 2 : STACK_TABLE_MIN;
+		tree_data = (struct tree_node *) realloc(tree_data, sizeof (struct tree_node) * tree_data_size);
+		if (tree_data == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	node = &tree_data[number_tree_nodes];
+	bzero(node, sizeof (struct tree_node));
+	node->frame = frame;
+	node->parent = parent;
+	node->hash = hash;
+	if (number_tree_nodes) {
+		node->next_sibling = tree_data[parent].first_child;
+		tree_data[parent].first_child = number_tree_nodes;
+	}
+	return(number_tree_nodes++);
+}
+
+/*
+ * Locate the child of parent for frame, adding it if need be.
+ */
+static size_t
+tree_child(size_t parent, unsigned int frame)
+{
+	unsigned long hash;
+	size_t slot;
+	size_t mask;
+	size_t node;
+
+	if (number_tree_nodes * 2 >= tree_table_size)
+		grow_tree_table();
+
+	hash = (((unsigned long) parent << 32) ^ frame) * 0x9e3779b97f4a7c15UL;
+	hash ^= hash >> 29;
+	mask = tree_table_size - 1;
+	for (slot = hash & mask; tree_table[slot]; slot = (slot + 1) & mask) {
+		node = tree_table[slot] - 1;
+		if (tree_data[node].parent == parent && tree_data[node].frame == frame)
+			return(node);
+	}
+	node = new_tree_node(frame, parent, hash);
+	tree_table[slot] = node + 1;
+	return(node);
+}
+
+/*
+ * Fold the data of a stack into a node of the call tree.
+ */
+static void
+add_tree_data(struct tree_node *node, struct lock_info *entry)
+{
+	node->data[ACQ_DATA_HOLD_COUNT] += entry->data[ACQ_DATA_HOLD_COUNT];
+	node->data[HD_DATA_HOLD_COUNT] += entry->data[HD_DATA_HOLD_COUNT];
+	node->total[TIME_ACQ] += entry->total[TIME_ACQ];
+	node->total[TIME_HOLD] += entry->total[TIME_HOLD];
+	if (node->data[ACQ_DATA_HOLD_MAX] < entry->data[ACQ_DATA_HOLD_MAX])
+		node->data[ACQ_DATA_HOLD_MAX] = entry->data[ACQ_DATA_HOLD_MAX];
+	if (node->data[HD_DATA_HOLD_MAX] < entry->data[HD_DATA_HOLD_MAX])
+		node->data[HD_DATA_HOLD_MAX] = entry->data[HD_DATA_HOLD_MAX];
+}
+
+/*
+ * Build the call tree from lock_data in one pass, each stack being walked from its
+ * outermost frame down to the caller of mutex_lock.  If caller is not NULL, only the
+ * stacks called from that frame are included.
+ */
+static void
+build_tree(char *caller)
+{
+	struct lock_info *wptr;
+	size_t count;
+	size_t level;
+	size_t node;
+
+	number_tree_nodes = 0;
+	if (tree_table_size)
+		bzero(tree_table, sizeof (size_t) * tree_table_size);
+	(void) new_tree_node(0, 0, 0);
+
+	for (count = 0; count < number_lock_entries; count++) {
+		wptr = &lock_data[count];
+		if (caller != NULL && !frame_is(wptr->frames[1], caller))
+			continue;
+		add_tree_data(&tree_data[0], wptr);
+		node = 0;
+		for (level = wptr->number_frames - 1; level >= 1; level--) {
+			node = tree_child(node, wptr->frames[level]);
+			add_tree_data(&tree_data[node], wptr);
+		}
+		tree_data[node].self_time[TIME_ACQ] += wptr->total[TIME_ACQ];
+		tree_data[node].self_time[TIME_HOLD] += wptr->total[TIME_HOLD];
+	}
+	for (node = 0; node < number_tree_nodes; node++)
+		finish_data(tree_data[node].data, tree_data[node].total, NULL, NULL);
+}
+
+/*
+ * Data field the call tree is sorted on, from the -S option.
+ */
+static int tree_sort_field;
+
+static int
+sort_tree(const void *n1_ptr, const void *n2_ptr)
+{
+	struct tree_node *n1 = &tree_data[*(size_t *) n1_ptr];
+	struct tree_node *n2 = &tree_data[*(size_t *) n2_ptr];
+
+	if (n1->data[tree_sort_field] < n2->data[tree_sort_field])
+		return(1);
+	if (n1->data[tree_sort_field] > n2->data[tree_sort_field])
+		return(-1);
+	return(0);
+}
+
+/*
+ * Print node, then its children (sorted, at most numb_to_show of them), indented
+ * one more level, down to max_depth levels (0 for all of them).
+ */
+static void
+dump_tree_node(FILE *fd, size_t node, int level, int max_depth, int numb_to_show)
+{
+	struct tree_node *nptr = &tree_data[node];
+	size_t *children;
+	size_t number_children = 0;
+	size_t child;
+	size_t count;
+	int width;
+
+	if (node) {
+		width = 48 - 2 * level;
+		fprintf(fd, "%*s%-*s%15ld%20ld%15ld%15ld%20ld%20ld%15ld\n", 2 * level, "",
+		    (width > 0) ? width : 0, frame_data[nptr->frame].name,
+		    nptr->data[HD_DATA_HOLD_COUNT], nptr->data[HD_DATA_TOTAL_TIME],
+		    nptr->data[HD_DATA_HOLD_MAX], nptr->data[ACQ_DATA_HOLD_COUNT],
+		    nptr->data[ACQ_DATA_TOTAL_TIME], sum_to_long(nptr->self_time[TIME_ACQ]),
+		    nptr->data[ACQ_DATA_HOLD_MAX]);
+	}
+	if (max_depth && level >= max_depth)
+		return;
+
+	for (child = nptr->first_child; child; child = tree_data[child].next_sibling)
+		number_children++;
+	if (number_children == 0)
+		return;
+	children = (size_t *) malloc(sizeof (size_t) * number_children);
+	if (children == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	count = 0;
+	for (child = nptr->first_child; child; child = tree_data[child].next_sibling)
+		children[count++] = child;
+	qsort(children, number_children, sizeof (size_t), sort_tree);
+	if ((size_t) numb_to_show < number_children)
+		number_children = numb_to_show;
+	for (count = 0; count < number_children; count++)
+		dump_tree_node(fd, children[count], level + 1, max_depth, numb_to_show);
+	free(children);
+}
+
+/*
+ * Dump the call tree, the time columns are totals (inclusive of every stack under
+ * the frame), other than ACQs Self which is for mutex_lock called directly from it.
+ */
+static void
+dump_tree(FILE *fd, int sort_option, int max_depth, int numb_to_show)
+{
+	static int sort_fields[] = {
+		HD_DATA_HOLD_COUNT, HD_DATA_HOLD_MAX, HD_DATA_HOLD_AVG, HD_DATA_TOTAL_TIME,
+		ACQ_DATA_HOLD_COUNT, ACQ_DATA_HOLD_MAX, ACQ_DATA_HOLD_AVG, ACQ_DATA_TOTAL_TIME
+	};
+
+	tree_sort_field = sort_fields[(sort_option >= HOLDS && sort_option <= ACQS_SPENT) ? sort_option :
+	    ACQS_SPENT];
+	fprintf(fd, "%-48s%15s%20s%15s%15s%20s%20s%15s\n", "call tree", count_title(1),
+	    "Hold Tot (ns)", "Hold Max (ns)", count_title(0), "ACQs Tot (ns)", "ACQs Self (ns)", "ACQs Max (ns)");
+	dump_tree_node(fd, 0, 0, max_depth, numb_to_show);
+}
+
+/*
+ * Write the call tree out as folded stacks, the input of flamegraph.pl.  One line
+ * per frame that calls mutex_lock, its frames from the outermost in separated by ';',
+ * followed by the time spent there: the hold time if sorting on a hold field,
+ * otherwise the acquire time.
+ */
+static void
+dump_folded(char *file, int sort_option)
+{
+	FILE *fd;
+	size_t *path;
+	size_t depth;
+	size_t node;
+	size_t count;
+	int which = (sort_option >= HOLDS && sort_option <= HOLDS_SPENT) ? TIME_HOLD : TIME_ACQ;
+
+	fd = fopen(file, "w");
 	if (fd == NULL) {
-		perror(BPFTRACE);
+		perror(file);
+		return;
+	}
+	path = (size_t *) malloc(sizeof (size_t) * (number_tree_nodes + 1));
+	if (path == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	/* Walk the tree depth first, path holding the nodes from the root down */
+	depth = 0;
+	node = tree_data[0].first_child;
+	while (node) {
+		path[depth++] = node;
+		if (tree_data[node].self_time[which]) {
+			for (count = 0; count < depth; count++)
+				fprintf(fd, "%s%s", count ? ";" : "", frame_data[tree_data[path[count]].frame].name);
+			fprintf(fd, " %ld\n", sum_to_long(tree_data[node].self_time[which]));
+		}
+		if (tree_data[node].first_child) {
+			node = tree_data[node].first_child;
+			continue;
+		}
+		while (depth && tree_data[path[depth - 1]].next_sibling == 0)
+			depth--;
+		node = depth ? tree_data[path[--depth]].next_sibling : 0;
+	}
+	free(path);
+	if (fclose(fd))
+		perror(file);
+}
+
+/*
+ * Throw away the data of the interval just reported, keeping the space allocated
+ * for the next one.
+ */
+static void
+reset_data()
+{
+	size_t count;
+
+	for (count = 0; count < number_cons_entries; count++)
+		hist_free(cons_data[count].hist);
+	for (count = 0; count < number_lock_entries; count++) {
+		if (hh_budget)
+			free(lock_data[count].frames);
+		hist_free(lock_data[count].hist);
+	}
+	arena_reset(&stack_arena);
+	number_lock_entries = 0;
+	number_cons_entries = 0;
+	hist_free(other_data.hist);
+	bzero(&other_data, sizeof (other_data));
+	hh_folded = 0;
+	hh_fold_max = 0;
+	hh_prior_error = 0;
+	bzero(totals, sizeof (totals));
+	bzero(total_times, sizeof (total_times));
+	if (stack_table_size)
+		bzero(stack_table, sizeof (size_t) * stack_table_size);
+}
+
+/*
+ * Report on the data at each of the stack depths asked for, or as a call tree.  The
+ * data is only consolidated again for each depth, not parsed again.
+ */
+static void
+report_data()
+{
+	int previous = phase_begin(PHASE_DUMP);
+	int sdepth;
+
+	/* Each interval reports on the stacks parsed since the last */
+	phase_stats[PHASE_PARSE].items += (double) number_lock_entries;
+	if (number_lock_entries > number_stacks)
+		number_stacks = number_lock_entries;
+
+	if (report.format == FORMAT_TEXT) {
+		if (capture_info[0])
+			fputs(capture_info, report.fd);
+		dump_sampling(report.fd);
+		dump_budget(report.fd);
+	}
+	if (report.tree || report.folded_file) {
+		(void) phase_begin(PHASE_ORGANIZE);
+		build_tree(report.caller);
+		(void) phase_begin(PHASE_DUMP);
+		phase_stats[PHASE_ORGANIZE].items += (double) number_lock_entries;
+		phase_stats[PHASE_DUMP].items += (double) number_tree_nodes;
+		if (report.folded_file)
+			dump_folded(report.folded_file, report.sort_option);
+		if (report.tree) {
+			dump_tree(report.fd, report.sort_option, report.tree_depth, report.numb_to_show);
+			(void) fflush(report.fd);
+			(void) phase_begin(previous);
+			return;
+		}
+	}
+	for (sdepth = report.first_depth; sdepth <= report.last_depth; sdepth++) {
+		if (report.last_depth > report.first_depth && report.format == FORMAT_TEXT)
+			fprintf(report.fd, "\nStack depth %d\n", sdepth);
+		(void) phase_begin(PHASE_ORGANIZE);
+		organize_data(sdepth, report.locks);
+		(void) phase_begin(PHASE_DUMP);
+		phase_stats[PHASE_ORGANIZE].items += (double) number_lock_entries;
+		phase_stats[PHASE_DUMP].items += (double) number_cons_entries;
+		number_callers = number_cons_entries;
+		if (report.format != FORMAT_TEXT)
+			dump_format(report.fd, report.format, report.caller, report.sort_option,
+			    report.numb_to_show, sdepth);
+		else if (report.diff)
+			dump_diff(report.fd, report.caller, report.sort_option, report.numb_to_show);
+		else if (report.locks)
+			dump_locks(report.fd, report.caller, report.sort_option, report.numb_to_show);
+		else
+			dump_data(report.fd, report.caller, report.sort_option, report.numb_to_show);
+	}
+	(void) fflush(report.fd);
+	(void) phase_begin(previous);
+}
+
+/*
+ * Called at the end of each interval's data, report on it and start over.
+ */
+static void
+report_interval()
+{
+	time_t now = time(NULL);
+	char stamp[64];
+
+	(void) strftime(stamp, sizeof (stamp), "%F %T", localtime(&now));
+	if (report.format == FORMAT_TEXT)
+		fprintf(report.fd, "\nInterval %d: %s\n", ++report.intervals, stamp);
+	else
+		report.intervals++;
+	report_data();
+	(void) fflush(report.fd);
+	reset_data();
+}
+
+/*
+ * Add file to the captures to reduce, as run.
+ */
+static void
+add_capture(char *file, unsigned int run)
+{
+	capture_files = (char **) realloc(capture_files, sizeof (char *) * (number_captures + 1));
+	capture_runs = (unsigned int *) realloc(capture_runs, sizeof (unsigned int) * (number_captures + 1));
+	if (capture_files == NULL || capture_runs == NULL) {
+		perror("realloc");
 		exit(EXIT_FAILURE);
 	}
+	capture_files[number_captures] = file;
+	capture_runs[number_captures++] = run;
+}
 
-	fprintf(fd, "#!/usr/local/bin/bpftrace\n\n");
-	if (interval) {
-		strcpy(buffer, "@interval,");
-		fprintf(fd, "BEGIN\n{\n	@interval = 1;\n}\n\n");
-	} else {
-		buffer[0] = '\0';
+static void
+usage(char *execname)
+{
+	fprintf(stderr, "usage %s:\n", execname);
+	fprintf(stderr, "\t-b <kprobe|contention>: what to trace with, default kprobe\n");
+	fprintf(stderr, "\t\tkprobe: probe every mutex_lock/mutex_unlock, acquire and hold times\n");
+	fprintf(stderr, "\t\tcontention: lock:contention_begin/end, only contended mutexes, no hold times\n");
+	fprintf(stderr, "\t-C <func name> Just those stacks that the lock was called from this function\n");
+	fprintf(stderr, "\t-c <command> command to execute, if null, will reduce the data designated by -f\n");
+	fprintf(stderr, "\t-D <file name>: baseline to compare the -f data with, ranked on the change\n");
+	fprintf(stderr, "\t\tin total time (-S 1 or 5: in tail latency), -S 0 to 3 on the holds\n");
+	fprintf(stderr, "\t-d: record the sums of squares, report the standard deviations\n");
+	fprintf(stderr, "\t-F <csv|json|folded>: report format, default text\n");
+	fprintf(stderr, "\t\tcsv and json (one object a line): every field, the stack in full\n");
+	fprintf(stderr, "\t\tfolded: flamegraph.pl input, weighted by hold time with -S 0 to 3\n");
+	fprintf(stderr, "\t-f <file name> name of data file to read from, with -c save the data there\n");
+	fprintf(stderr, "\t\tmore than one (-f a b ... or -f a -f b), merge them\n");
+	fprintf(stderr, "\t-G <cgroup path>: only trace the tasks in this cgroup\n");
+	fprintf(stderr, "\t-g <file name>: write the call tree as folded stacks (flamegraph.pl input)\n");
+	fprintf(stderr, "\t-H <bits>: per stack latency histograms, report p50/p90/p99/p99.9\n");
+	fprintf(stderr, "\t\t2^bits buckets per power of 2, 0 for plain log2 (older bpftrace)\n");
+	fprintf(stderr, "\t-h: help message\n");
+	fprintf(stderr, "\t-i <secs>: report lock information every x seconds, without -c or -f\n");
+	fprintf(stderr, "\t\ttrace until interrupted\n");
+	fprintf(stderr, "\t-j <#>: threads to reduce a data file (-f) with, 0 for one per CPU\n");
+	fprintf(stderr, "\t-k <file name>: kallsyms to resolve raw stacks and locks with, default %s\n", KALLSYMS);
+	fprintf(stderr, "\t-l: key the data by lock as well, report the hot locks and their callers\n");
+	fprintf(stderr, "\t-m <#>: keep at most # stacks, the rest folded into [other]\n");
+	fprintf(stderr, "\t-n <#>: Number of locks to show.\n");
+	fprintf(stderr, "\t-o <file name>: output file\n");
+	fprintf(stderr, "\t-P <#>: only capture the stacks of 1 in # acquisitions, counts are scaled up\n");
+	fprintf(stderr, "\t-p: only trace the -c command and the processes it forks\n");
+	fprintf(stderr, "\t-R: break the data out by capture (-f) as well, in a Run column\n");
+	fprintf(stderr, "\t-r: record raw stack addresses, resolved by us instead of bpftrace\n");
+	fprintf(stderr, "\t-s <value>[-<value>] depth of stack to show, with a range report each depth\n");
+	fprintf(stderr, "\t-T <ns>: only break out by stack acquisitions and holds taking at least ns\n");
+	fprintf(stderr, "\t\tonly contention takes just their stacks, kprobe still takes every one\n");
+	fprintf(stderr, "\t-t: report a call tree, with -s the number of levels shown\n");
+	fprintf(stderr, "\t-V <file name>: append the -v stats to the file, a JSON object a line\n");
+	fprintf(stderr, "\t-v: report the time of each phase, the sections parsed and memory used\n");
+	fprintf(stderr, "\t-w <file name>: save the reduced data as a snapshot, to load with -f\n");
+	fprintf(stderr, "\t-S <sort on>[,<then on>]: recognized values, optionally a secondary sort\n");
+	fprintf(stderr, "\t\t0: # holds\n");
+	fprintf(stderr, "\t\t1: Hold Max\n");
+	fprintf(stderr, "\t\t2: Hold Avg\n");
+	fprintf(stderr, "\t\t3: Hold total\n");
+	fprintf(stderr, "\t\t4: # ACQs\n");
+	fprintf(stderr, "\t\t5: # ACQs Max\n");
+	fprintf(stderr, "\t\t6: # ACQs average\n");
+	fprintf(stderr, "\t\t7: # ACQs total time (exact sum), default\n");
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Emit the printing of the aggregation maps, one section per map.  Each report is
+ * terminated by an END OF DATA section.  The hold maps are only there if hold is set.
+ * When sampling or with a threshold, the sampling section comes first so the
+ * reducer knows how to scale what follows, and the unkeyed totals of every
+ * acquisition and hold are printed as well.
+ */
+static void
+bpftrace_print_maps(FILE *fd, int hold)
+{
+	if (trace.sample > 1 || trace.threshold) {
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprintf(\"mutex sampling\\n\");\n");
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprintf(\"rate %d threshold %ld\\n\");\n", trace.sample > 1 ? trace.sample : 1,
+		    trace.threshold);
+
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprintf(\"mutex aq all\\n\");\n");
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprint(@aq_all);\n");
+		if (hold) {
+			fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+			fprintf(fd, "\tprintf(\"mutex hold all\\n\");\n");
+			fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+			fprintf(fd, "\tprint(@hl_all);\n");
+		}
+	}
+
+	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+	fprintf(fd, "\tprintf(\"mutex aq stats\\n\");\n");
+	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+	fprintf(fd, "\tprint(@aq_report_stats);\n");
+
+	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+	fprintf(fd, "\tprintf(\"mutex aq max\\n\");\n");
+	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+	fprintf(fd, "\tprint(@aq_report_max);\n");
+
+	if (hold) {
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprintf(\"mutex hold stats\\n\");\n");
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprint(@hl_report_stats);\n");
+
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprintf(\"mutex hold max\\n\");\n");
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprint(@hl_report_max);\n");
+	}
+
+	if (trace.squares) {
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprintf(\"mutex aq squares high\\n\");\n");
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprint(@aq_report_sqhi);\n");
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprintf(\"mutex aq squares low\\n\");\n");
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprint(@aq_report_sqlo);\n");
+		if (hold) {
+			fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+			fprintf(fd, "\tprintf(\"mutex hold squares high\\n\");\n");
+			fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+			fprintf(fd, "\tprint(@hl_report_sqhi);\n");
+			fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+			fprintf(fd, "\tprintf(\"mutex hold squares low\\n\");\n");
+			fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+			fprintf(fd, "\tprint(@hl_report_sqlo);\n");
+		}
+	}
+
+	if (trace.histograms) {
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprintf(\"mutex aq hist\\n\");\n");
+		fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+		fprintf(fd, "\tprint(@aq_report_hist);\n");
+		if (hold) {
+			fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+			fprintf(fd, "\tprintf(\"mutex hold hist\\n\");\n");
+			fprintf(fd, "\tprintf(\"========================================\\n\");\n");
+			fprintf(fd, "\tprint(@hl_report_hist);\n");
+		}
+	}
+
+	fprintf(fd, "\tprintf(\"=======================================\\n\");\n");
+	fprintf(fd, "\tprintf(\"END OF DATA\\n\");\n");
+	fprintf(fd, "\tprintf(\"=======================================\\n\");\n");
+}
+
+/*
+ * Build the condition an acquisition has to meet for its stack to be aggregated,
+ * sampled (1 in trace.sample) and/or taking at least trace.threshold ns.  sampled is
+ * the map telling if the acquisition was sampled.  Returns an empty string if every
+ * acquisition is aggregated.
+ */
+static const char *
+bpftrace_condition(char *buffer, size_t size, const char *sampled)
+{
+	buffer[0] = '\0';
+	if (trace.sample > 1 && trace.threshold)
+		(void) snprintf(buffer, size, "%s && $val >= %ld", sampled, trace.threshold);
+	else if (trace.sample > 1)
+		(void) snprintf(buffer, size, "%s", sampled);
+	else if (trace.threshold)
+		(void) snprintf(buffer, size, "$val >= %ld", trace.threshold);
+	return(buffer);
+}
+
+/*
+ * Return the predicate that scopes the probes to the traced processes, "" when the
+ * whole system is traced.  The pid tree is tracked in @traced, keyed by tid as the
+ * fork/exit tracepoints report thread ids; a cgroup is a compare against a builtin,
+ * so costs no map lookup at all.  Either way it is tested first, so out of scope
+ * probes do no map work.
+ */
+static const char *
+bpftrace_scope(char *buffer, size_t size)
+{
+	buffer[0] = '\0';
+	if (trace.pid_tree)
+		(void) snprintf(buffer, size, "@traced[tid]");
+	else if (trace.cgroup)
+		(void) snprintf(buffer, size, "cgroup == cgroupid(\"%s\")", trace.cgroup);
+	return(buffer);
+}
+
+/*
+ * Emit the taking of the stack (and lock) of an acquisition into the stack and lock
+ * maps.  indent is the indentation of the current block.
+ */
+static void
+bpftrace_stack(FILE *fd, const char *indent, const char *stack, const char *lock,
+    const char *lock_value)
+{
+	fprintf(fd, "%s%s = %s;\n", indent, stack, trace.raw ? "kstack(raw)" : "kstack()");
+	if (trace.locks)
+		fprintf(fd, "%s%s = %s;\n", indent, lock, lock_value);
+}
+
+/*
+ * Emit the aggregation of $val into the report maps, keyed by key, subject to
+ * condition.  indent is the indentation of the current block.  If stack is not NULL,
+ * the stack (and lock) the key is made of are only taken here, once condition is met.
+ * With histograms, a log2 histogram (hist_bits 0) or a log-linear one, with
+ * 2^hist_bits buckets per power of 2, is kept per key as well.
+ */
+static void
+bpftrace_aggregate(FILE *fd, const char *indent, const char *condition, const char *map,
+    const char *key, const char *stack, const char *lock, const char *lock_value)
+{
+	char inner[16];
+
+	if (trace.sample > 1 || trace.threshold)
+		fprintf(fd, "%s%s_all = stats($val);\n", indent, map);
+	if (condition[0]) {
+		fprintf(fd, "%sif (%s) {\n", indent, condition);
+		(void) snprintf(inner, sizeof (inner), "%s\t", indent);
+		indent = inner;
+	}
+	if (stack)
+		bpftrace_stack(fd, indent, stack, lock, lock_value);
+	fprintf(fd, "%s%s_report_stats[%s] = stats($val);\n", indent, map, key);
+	fprintf(fd, "%s%s_report_max[%s] = max($val);\n", indent, map, key);
+	if (trace.squares) {
+		fprintf(fd, "%s%s_report_sqhi[%s] = sum(($val * $val) >> 32);\n", indent, map, key);
+		fprintf(fd, "%s%s_report_sqlo[%s] = sum(($val * $val) & 0xffffffff);\n", indent, map, key);
+	}
+	if (trace.histograms && trace.hist_bits)
+		fprintf(fd, "%s%s_report_hist[%s] = hist($val, %d);\n", indent, map, key, trace.hist_bits);
+	else if (trace.histograms)
+		fprintf(fd, "%s%s_report_hist[%s] = hist($val);\n", indent, map, key);
+	if (condition[0])
+		fprintf(fd, "%s}\n", indent + 1);
+}
+
+/*
+ * Emit the capture of the stack (and lock) of an acquisition, for 1 in trace.sample
+ * of them.  With a NULL stack, only whether the acquisition is sampled is recorded,
+ * the stack is taken later (see bpftrace_aggregate()).
+ */
+static void
+bpftrace_capture(FILE *fd, const char *stack, const char *lock, const char *lock_value,
+    const char *sampled)
+{
+	const char *indent = "\t";
+
+	if (trace.sample > 1) {
+		fprintf(fd, "\tif (rand %% %d == 0) {\n", trace.sample);
+		fprintf(fd, "\t\t%s = 1;\n", sampled);
+		indent = "\t\t";
 	}
+	if (stack)
+		bpftrace_stack(fd, indent, stack, lock, lock_value);
+	if (trace.sample > 1)
+		fprintf(fd, "\t}\n");
+}
+
+/*
+ * Emit the kprobe backend, mutex_lock and mutex_unlock are probed on every call.  The
+ * time to acquire runs from entry to return of mutex_lock, the hold time from then
+ * until mutex_unlock.  The stack is taken on entry to mutex_lock even with a
+ * threshold (-T): the hold is keyed by it, and how long it is held is only known
+ * at mutex_unlock, once the stack of the acquisition is gone.
+ */
+static void
+bpftrace_kprobes(FILE *fd)
+{
+	const char *aq_key;
+	const char *hl_key;
+	char condition[256];
+	char scope_buffer[PATH_MAX + 32];
+	const char *scope = bpftrace_scope(scope_buffer, sizeof (scope_buffer));
+	const char *and = scope[0] ? " && " : "";
 
+	if (trace.locks) {
+		aq_key = "@lock[tid, @lock_depth[tid] -1], @stack[tid, @lock_depth[tid] -1]";
+		hl_key = "@lock[tid, @lock_depth[tid]], @stack[tid, @lock_depth[tid]]";
+	} else {
+		aq_key = "@stack[tid, @lock_depth[tid] -1]";
+		hl_key = "@stack[tid, @lock_depth[tid]]";
+	}
 
 	fprintf(fd, "kprobe:mutex_lock\n");
+	if (scope[0])
+		fprintf(fd, "\t/ %s /\n", scope);
 	fprintf(fd, "{\n");
 	fprintf(fd, "\t@track[tid] = 1;\n");
-	fprintf(fd, "\t@stack[tid, @lock_depth[tid]] = kstack();\n");
+	bpftrace_capture(fd, "@stack[tid, @lock_depth[tid]]", "@lock[tid, @lock_depth[tid]]", "arg0",
+	    "@sampled[tid, @lock_depth[tid]]");
 	fprintf(fd, "\t@time[tid] = nsecs;\n");
 	fprintf(fd, "\t@lock_depth[tid] = @lock_depth[tid] + 1;\n");
 	fprintf(fd, "}\n");
 	fprintf(fd, "kretprobe:mutex_lock\n");
-	fprintf(fd, "\t/ @track[tid] == 1 /\n");
+	fprintf(fd, "\t/ %s%s@track[tid] == 1 /\n", scope, and);
 	fprintf(fd, "{\n");
 	fprintf(fd, "\t$temp = nsecs;\n");
 	fprintf(fd, "\tif ($temp > @time[tid]) {\n");
-	fprintf(fd, "\t\t@aq_report_avg[%s @stack[tid, @lock_depth[tid] -1]] = avg($temp - @time[tid]);\n", buffer);
-	fprintf(fd, "\t\t@aq_report_max[%s @stack[tid, @lock_depth[tid] -1]] = max($temp - @time[tid]);\n", buffer);
-	fprintf(fd, "\t\t@aq_report_count[%s @stack[tid, @lock_depth[tid] -1]] = count();\n", buffer);
+	fprintf(fd, "\t\t$val = $temp - @time[tid];\n");
+	bpftrace_aggregate(fd, "\t\t", bpftrace_condition(condition, sizeof (condition),
+	    "@sampled[tid, @lock_depth[tid] - 1]"), "@aq", aq_key, NULL, NULL, NULL);
 	fprintf(fd, "\t}\n");
 	fprintf(fd, "\t@time_held[tid, @lock_depth[tid] - 1] = nsecs;\n");
-	fprintf(fd, "\t@track[tid] = 0;\n");
+	fprintf(fd, "\tdelete(@track[tid]);\n");
+	fprintf(fd, "\tdelete(@time[tid]);\n");
 	fprintf(fd, "}\n\n");
 
 
 	fprintf(fd, "kprobe:mutex_unlock\n");
-	fprintf(fd, "\t/ @lock_depth[tid] > 0 /\n");
+	fprintf(fd, "\t/ %s%s@lock_depth[tid] > 0 /\n", scope, and);
 	fprintf(fd, "{\n");
 	fprintf(fd, "\t$temp = nsecs;\n");
 	fprintf(fd, "\t@lock_depth[tid] = @lock_depth[tid] - 1;\n");
@@ -668,176 +5260,467 @@ bpftrace_create(int interval)
 	fprintf(fd, "\t\t$val = $temp - @time_held[tid, @lock_depth[tid]];\n");
 	fprintf(fd, "\t\tif ($val < 1000000000) {\n");
 	fprintf(fd, "\t\t\t@hl_histo = hist($val);\n");
-	fprintf(fd, "\t\t\t@hl_report_avg[%s @stack[tid, @lock_depth[tid]]] = avg($val);\n", buffer);
-	fprintf(fd, "\t\t\t@hl_report_max[%s @stack[tid, @lock_depth[tid]]] = max($val);\n", buffer);
-	fprintf(fd, "\t\t\t@hl_report_count[%s @stack[tid, @lock_depth[tid]]] = count();\n", buffer);
+	bpftrace_aggregate(fd, "\t\t\t", bpftrace_condition(condition, sizeof (condition),
+	    "@sampled[tid, @lock_depth[tid]]"), "@hl", hl_key, NULL, NULL, NULL);
 	fprintf(fd, "\t\t}\n");
 	fprintf(fd, "\t}\n");
 	fprintf(fd, "\tdelete(@stack[tid, @lock_depth[tid]]);\n");
 	fprintf(fd, "\tdelete(@time_held[tid, @lock_depth[tid]]);\n");
+	if (trace.locks)
+		fprintf(fd, "\tdelete(@lock[tid, @lock_depth[tid]]);\n");
+	if (trace.sample > 1)
+		fprintf(fd, "\tdelete(@sampled[tid, @lock_depth[tid]]);\n");
+	fprintf(fd, "\tif (@lock_depth[tid] == 0) {\n");
+	fprintf(fd, "\t\tdelete(@lock_depth[tid]);\n");
+	fprintf(fd, "\t}\n");
 	fprintf(fd, "}\n");
+}
 
-	if (interval) {
-		fprintf(fd, "interval:s:%d\n", interval);
-		fprintf(fd, "{\n	@interval = @interval + 1;\n}\n");
-	}
+/*
+ * Emit the contention backend, built on the lock:contention_begin/end tracepoints.
+ * These only fire when a mutex is actually contended (LCB_F_MUTEX in the flags), so
+ * the uncontended fast path costs nothing, and a stack is only taken when there is
+ * contention.  The time to acquire is the time spent waiting, there is no hold time.
+ * __mutex_lock_common() fires contention_begin more than once for one acquisition,
+ * before spinning (LCB_F_SPIN set) and again each time it goes to sleep, so only the
+ * first begin is recorded: the wait is timed from there, and the stack, lock and
+ * sampling are taken once, until contention_end clears them.  With a threshold (-T),
+ * the stack and lock are only taken at contention_end, once the wait is known to be
+ * long enough: the frames of the caller are still there, under the slow path.
+ */
+static void
+bpftrace_contention(FILE *fd)
+{
+	const char *aq_key = trace.locks ? "@clock[tid], @cstack[tid]" : "@cstack[tid]";
+	const char *late = trace.threshold ? "@cstack[tid]" : NULL;
+	char condition[256];
+	char scope_buffer[PATH_MAX + 32];
+	const char *scope = bpftrace_scope(scope_buffer, sizeof (scope_buffer));
+	const char *and = scope[0] ? " && " : "";
 
-	fprintf(fd, "END\n");
+	fprintf(fd, "tracepoint:lock:contention_begin\n");
+	fprintf(fd, "\t/ %s%s(args->flags & %d) && !@ctime[tid] /\n", scope, and, LCB_F_MUTEX);
 	fprintf(fd, "{\n");
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprintf(\"mutex aq _averages\\n\");\n");
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprint(@aq_report_avg);\n");
+	bpftrace_capture(fd, late ? NULL : "@cstack[tid]", "@clock[tid]", "(uint64) args->lock_addr",
+	    "@csampled[tid]");
+	fprintf(fd, "\t@ctime[tid] = nsecs;\n");
+	fprintf(fd, "}\n");
+	fprintf(fd, "tracepoint:lock:contention_end\n");
+	fprintf(fd, "\t/ %s%s@ctime[tid] /\n", scope, and);
+	fprintf(fd, "{\n");
+	fprintf(fd, "\t$val = nsecs - @ctime[tid];\n");
+	bpftrace_aggregate(fd, "\t", bpftrace_condition(condition, sizeof (condition), "@csampled[tid]"),
+	    "@aq", aq_key, late, "@clock[tid]", "(uint64) args->lock_addr");
+	fprintf(fd, "\tdelete(@ctime[tid]);\n");
+	fprintf(fd, "\tdelete(@cstack[tid]);\n");
+	if (trace.locks)
+		fprintf(fd, "\tdelete(@clock[tid]);\n");
+	if (trace.sample > 1)
+		fprintf(fd, "\tdelete(@csampled[tid]);\n");
+	fprintf(fd, "}\n");
+}
 
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprintf(\"mutex aq max\\n\");\n");
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprint(@aq_report_max);\n");
+/*
+ * Generate the required bpftrace script.  With an interval, the aggregation maps are
+ * printed and then cleared every interval seconds, so they only ever hold the data of
+ * one interval.  With raw, the stacks are recorded as addresses, which we resolve
+ * ourselves rather than having bpftrace symbolize every frame.  With locks, the maps
+ * are keyed by the address of the mutex as well as the stack.
+ */
+static void
+bpftrace_create()
+{
+	FILE *fd;
+	int hold = (trace.backend == BACKEND_KPROBE);
 
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprintf(\"mutex aq count\\n\");\n");
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprint(@aq_report_count);\n");
+	fd = fopen(BPFTRACE, "w");
+	if (fd == NULL) {
+		perror(BPFTRACE);
+		exit(EXIT_FAILURE);
+	}
 
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprintf(\"mutex hold avg\\n\");\n");
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprint(@hl_report_avg);\n");
+	fprintf(fd, "#!/usr/local/bin/bpftrace\n\n");
 
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprintf(\"mutex hold max\\n\");\n");
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprint(@hl_report_max);\n");
+	/* BEGIN only fires once all the probes are attached, tell the reducer */
+	fprintf(fd, "BEGIN\n");
+	fprintf(fd, "{\n");
+	if (trace.pid_tree) {
+		/* $1 is the pid of the command, follow it and all it forks */
+		fprintf(fd, "\t@traced[$1] = 1;\n");
+	}
+	fprintf(fd, "\tprintf(\"%s\\n\");\n", READY_LINE);
+	fprintf(fd, "}\n");
+	if (trace.pid_tree) {
+		fprintf(fd, "tracepoint:sched:sched_process_fork\n");
+		fprintf(fd, "\t/ @traced[args->parent_pid] /\n");
+		fprintf(fd, "{\n");
+		fprintf(fd, "\t@traced[args->child_pid] = 1;\n");
+		fprintf(fd, "}\n");
+		fprintf(fd, "tracepoint:sched:sched_process_exit\n");
+		fprintf(fd, "\t/ @traced[args->pid] /\n");
+		fprintf(fd, "{\n");
+		fprintf(fd, "\tdelete(@traced[args->pid]);\n");
+		fprintf(fd, "}\n\n");
+	}
 
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprintf(\"mutex hold count\\n\");\n");
-	fprintf(fd, "\tprintf(\"========================================\\n\");\n");
-	fprintf(fd, "\tprint(@hl_report_count);\n");
+	if (trace.backend == BACKEND_CONTENTION)
+		bpftrace_contention(fd);
+	else
+		bpftrace_kprobes(fd);
 
-	fprintf(fd, "\tprintf(\"=======================================\\n\");\n");
-	fprintf(fd, "\tprintf(\"END OF DATA\\n\");\n");
-	fprintf(fd, "\tprintf(\"=======================================\\n\");\n");
-	fprintf(fd, "\tclear(@track);\n");
-	fprintf(fd, "\tclear(@stack);\n");
-	fprintf(fd, "\tclear(@time_held);\n");
-	fprintf(fd, "\tclear(@time);\n");
-	fprintf(fd, "\tclear(@lock_depth);\n");
-	fprintf(fd, "\tdelete(@lock_depth);\n");
-	fprintf(fd, "\tdelete(@hl_report_avg);\n");
-	fprintf(fd, "\tdelete(@hl_report_max);\n");
-	fprintf(fd, "\tdelete(@hl_report_count);\n");
-	fprintf(fd, "\tdelete(@aq_report_avg);\n");
-	fprintf(fd, "\tdelete(@aq_report_max);\n");
-	fprintf(fd, "\tdelete(@aq_report_count);\n");
-	fprintf(fd, "\tdelete(@time_held);\n");
-	fprintf(fd, "\tdelete(@track);\n");
-	fprintf(fd, "\tdelete(@stack);\n");
-	fprintf(fd, "\tdelete(@time);\n");
+	if (trace.interval) {
+		fprintf(fd, "interval:s:%d\n", trace.interval);
+		fprintf(fd, "{\n");
+		bpftrace_print_maps(fd, hold);
+		fprintf(fd, "\tclear(@aq_report_stats);\n");
+		fprintf(fd, "\tclear(@aq_report_max);\n");
+		if (trace.histograms)
+			fprintf(fd, "\tclear(@aq_report_hist);\n");
+		if (trace.squares) {
+			fprintf(fd, "\tclear(@aq_report_sqhi);\n");
+			fprintf(fd, "\tclear(@aq_report_sqlo);\n");
+		}
+		if (trace.sample > 1 || trace.threshold)
+			fprintf(fd, "\tclear(@aq_all);\n");
+		if (hold) {
+			fprintf(fd, "\tclear(@hl_report_stats);\n");
+			fprintf(fd, "\tclear(@hl_report_max);\n");
+			if (trace.histograms)
+				fprintf(fd, "\tclear(@hl_report_hist);\n");
+			if (trace.squares) {
+				fprintf(fd, "\tclear(@hl_report_sqhi);\n");
+				fprintf(fd, "\tclear(@hl_report_sqlo);\n");
+			}
+			fprintf(fd, "\tclear(@hl_histo);\n");
+			if (trace.sample > 1 || trace.threshold)
+				fprintf(fd, "\tclear(@hl_all);\n");
+		}
+		fprintf(fd, "}\n");
+	}
+
+	fprintf(fd, "END\n");
+	fprintf(fd, "{\n");
+	bpftrace_print_maps(fd, hold);
+	if (trace.backend == BACKEND_CONTENTION) {
+		fprintf(fd, "\tclear(@cstack);\n");
+		fprintf(fd, "\tclear(@ctime);\n");
+		if (trace.locks)
+			fprintf(fd, "\tclear(@clock);\n");
+		fprintf(fd, "\tdelete(@aq_report_stats);\n");
+		fprintf(fd, "\tdelete(@aq_report_max);\n");
+		fprintf(fd, "\tdelete(@cstack);\n");
+		fprintf(fd, "\tdelete(@ctime);\n");
+		if (trace.locks)
+			fprintf(fd, "\tdelete(@clock);\n");
+		if (trace.sample > 1)
+			fprintf(fd, "\tdelete(@csampled);\n");
+		if (trace.sample > 1 || trace.threshold)
+			fprintf(fd, "\tdelete(@aq_all);\n");
+	} else {
+		fprintf(fd, "\tclear(@track);\n");
+		fprintf(fd, "\tclear(@stack);\n");
+		fprintf(fd, "\tclear(@time_held);\n");
+		fprintf(fd, "\tclear(@time);\n");
+		fprintf(fd, "\tclear(@lock_depth);\n");
+		if (trace.locks)
+			fprintf(fd, "\tclear(@lock);\n");
+		fprintf(fd, "\tdelete(@lock_depth);\n");
+		fprintf(fd, "\tdelete(@hl_report_stats);\n");
+		fprintf(fd, "\tdelete(@hl_report_max);\n");
+		fprintf(fd, "\tdelete(@aq_report_stats);\n");
+		fprintf(fd, "\tdelete(@aq_report_max);\n");
+		fprintf(fd, "\tdelete(@time_held);\n");
+		fprintf(fd, "\tdelete(@track);\n");
+		fprintf(fd, "\tdelete(@stack);\n");
+		if (trace.locks)
+			fprintf(fd, "\tdelete(@lock);\n");
+		if (trace.sample > 1)
+			fprintf(fd, "\tdelete(@sampled);\n");
+		if (trace.sample > 1 || trace.threshold) {
+			fprintf(fd, "\tdelete(@aq_all);\n");
+			fprintf(fd, "\tdelete(@hl_all);\n");
+		}
+		fprintf(fd, "\tdelete(@time);\n");
+	}
+	if (trace.histograms) {
+		fprintf(fd, "\tdelete(@aq_report_hist);\n");
+		if (hold)
+			fprintf(fd, "\tdelete(@hl_report_hist);\n");
+	}
+	if (trace.squares) {
+		fprintf(fd, "\tdelete(@aq_report_sqhi);\n");
+		fprintf(fd, "\tdelete(@aq_report_sqlo);\n");
+		if (hold) {
+			fprintf(fd, "\tdelete(@hl_report_sqhi);\n");
+			fprintf(fd, "\tdelete(@hl_report_sqlo);\n");
+		}
+	}
+	if (trace.pid_tree) {
+		fprintf(fd, "\tclear(@traced);\n");
+		fprintf(fd, "\tdelete(@traced);\n");
+	}
 	fprintf(fd, "}\n");
 	fclose(fd);
-	sprintf(buffer, "chmod 755 %s", BPFTRACE);
-	(void) system(buffer);
+	(void) chmod(BPFTRACE, 0755);
 }
 
 /*
- * Simple stub to goto on a signal.
+ * Set when we are told to stop tracing, by SIGINT or SIGTERM.
  */
+static volatile sig_atomic_t stop_tracing = 0;
+
 static void
-pause_stub()
+stop_stub()
 {
+	stop_tracing = 1;
 }
 
 /*
  * Start the bpftrace script, and then execute the command.  When the command is complete,
  * terminate the bpftrace script.  We can not simply do bpftrace -c <command> ./script > file
  * due to the fact that will redirect all stdout from the command as well as the script, which
- * is not desired.
+ * is not desired.  The output of bpftrace comes back to us over a pipe and is reduced as it
+ * arrives, if file is not NULL the output is saved there as well.  If there is no command,
+ * trace until we are interrupted (interval mode).
+ *
+ * The command is forked first, so its pid can be handed to the script (-p), and is held
+ * on the go pipe until the BEGIN probe of the script reports it is tracing.  bpftrace is
+ * in its own process group, so it is only ever interrupted by us, once.
  */
 static void
-execute_command(char *command, char *file)
+execute_command(char *command, char *file, void (*end_of_data)(void))
 {
+	struct stream_state ss;
+	struct pollfd pfd;
+	struct sigaction action;
 	pid_t bpftrace_pid;
-	pid_t command_pid;
-	char cmd_buffer[8192];
-	char buffer[1024];
+	pid_t command_pid = -1;
 	int status;
-	struct sigaction action, p_action;
-	int count;
-	FILE *fd;
-	char *ptr;
-	int field = 0;
+	int pipe_fd[2];
+	int go_fd[2] = { -1, -1 };
+	int running = 1;
+	char pid_arg[32];
+	char go = 'g';
 
-	/*
-	 * Always start bpftrace first.
-	 */
+	if (pipe(pipe_fd) < 0 || (command && pipe(go_fd) < 0)) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
 
-	if ((bpftrace_pid = fork()) == 0) {
-		/* bpftrace child */
-		sprintf(cmd_buffer, "%s > %s", BPFTRACE, file);
-		if ((bpftrace_pid = fork()) == 0) {
-			(void) system(cmd_buffer);
-			exit(EXIT_SUCCESS);
+	if (command) {
+		if ((command_pid = fork()) == 0) {
+			/* command  child */
+			(void) close(pipe_fd[0]);
+			(void) close(pipe_fd[1]);
+			(void) close(go_fd[1]);
+			if (read(go_fd[0], &go, 1) != 1)
+				_exit(EXIT_FAILURE);
+			(void) close(go_fd[0]);
+			(void) execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+			perror("/bin/sh");
+			_exit(EXIT_FAILURE);
 		}
-		if (bpftrace_pid < 0)
+		if (command_pid < 0) {
 			perror("fork");
-		bzero(&action, sizeof (struct sigaction));
-		action.sa_sigaction = pause_stub;
-		(void) sigemptyset(&action.sa_mask);
-		action.sa_flags = 0;
-
-		for (count = 0; count < _SIGRTMAX; count++) {
-			if (count != SIGCHLD &&
-			   count != SIGTSTP && count != SIGALRM &&
-			   count != SIGSEGV) {
-				sigaction(count, &action, &p_action);
-                	}
-        	}
-		(void) pause();
-		/* Find the pid for bpftrace and then sigint it */
-
-		(void) system("ps -efl |grep bpftrace |grep local > /tmp/junk");
-		fd =fopen("/tmp/junk","r");
-		while(fgets(buffer, 1024, fd)) {
-			if (strstr(buffer, "/usr/local/bin/bpftrace"))
-				break;
-		}
-		fclose(fd);
-		ptr = buffer;
-		/* Skip the fields, as there may be multiple spaces.... */
-		while (field != 3) {
-			while (isspace(ptr[0]))
-				ptr++;
-			field++;
-			while (!isspace(ptr[0]))
-				ptr++;
+			exit(EXIT_FAILURE);
 		}
-		kill(atoi(ptr), SIGINT);
+		(void) close(go_fd[0]);
+	}
 
-		(void) waitpid(bpftrace_pid, &status, 0);
-		exit(EXIT_SUCCESS);
+	(void) snprintf(pid_arg, sizeof (pid_arg), "%d", (int) command_pid);
+	if ((bpftrace_pid = fork()) == 0) {
+		/* bpftrace child */
+		(void) setpgid(0, 0);
+		/* We may have been started with interrupts ignored, bpftrace needs them */
+		(void) signal(SIGINT, SIG_DFL);
+		(void) dup2(pipe_fd[1], STDOUT_FILENO);
+		(void) close(pipe_fd[0]);
+		(void) close(pipe_fd[1]);
+		if (command)
+			(void) close(go_fd[1]);
+		if (trace.pid_tree)
+			(void) execl(BPFTRACE, BPFTRACE, pid_arg, (char *) NULL);
+		else
+			(void) execl(BPFTRACE, BPFTRACE, (char *) NULL);
+		perror(BPFTRACE);
+		_exit(EXIT_FAILURE);
 	}
-	/* Give it a chance */
-	(void) sleep(5);
-	if ((command_pid = fork()) == 0) {
-		/* command  child */
-		(void) system(command);
-		exit(EXIT_SUCCESS);
+	if (bpftrace_pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
 	}
-	/* Wait for the command to complete */
-	(void) waitpid(command_pid, &status, 0);
+	(void) close(pipe_fd[1]);
 
-	/* Command is complete, kill off bpftrace script. */
+	bzero(&action, sizeof (struct sigaction));
+	action.sa_handler = stop_stub;
+	(void) sigemptyset(&action.sa_mask);
+	(void) sigaction(SIGINT, &action, NULL);
+	(void) sigaction(SIGTERM, &action, NULL);
 
-	kill(bpftrace_pid, SIGINT);
-	/* Wait for the bpftrace to complete */
+	/*
+	 * Reduce the bpftrace output while waiting for the command to complete.  The
+	 * command is let go as soon as bpftrace says it is ready.  Once it is complete (or
+	 * we are interrupted), interrupt bpftrace and pick up the rest of its output.
+	 */
+	stream_init(&ss, file, end_of_data);
+	pfd.fd = pipe_fd[0];
+	pfd.events = POLLIN;
+	for (;;) {
+		if (poll(&pfd, 1, running ? 100 : -1) > 0 && stream_read(&ss, pipe_fd[0]) == 0)
+			break;
+		if (go_fd[1] >= 0 && ss.ps.ready) {
+			if (write(go_fd[1], &go, 1) != 1)
+				perror("write");
+			(void) close(go_fd[1]);
+			go_fd[1] = -1;
+		}
+		if (running && (stop_tracing || (command_pid > 0 && go_fd[1] < 0 &&
+		    waitpid(command_pid, &status, WNOHANG) != 0))) {
+			running = 0;
+			(void) kill(bpftrace_pid, SIGINT);
+		}
+	}
+	(void) close(pipe_fd[0]);
+	stream_done(&ss);
 	(void) waitpid(bpftrace_pid, &status, 0);
+
+	/* bpftrace went away before it was ready, the command never ran */
+	if (go_fd[1] >= 0) {
+		fprintf(stderr, "bpftrace exited before tracing started\n");
+		(void) close(go_fd[1]);
+		(void) waitpid(command_pid, &status, 0);
+	} else if (running && command_pid > 0 && !stop_tracing)
+		(void) waitpid(command_pid, &status, 0);
+}
+
+static void
+obtain_run_data(char *command, char *file)
+{
+	(void) phase_begin(PHASE_SCRIPT);
+	bpftrace_create();
+	(void) phase_begin(PHASE_TRACE);
+	execute_command(command, file, trace.interval ? report_interval : NULL);
+}
+
+static double
+timeval_seconds(const struct timeval *tv)
+{
+	return((double) tv->tv_sec + (double) tv->tv_usec / 1e6);
+}
+
+/*
+ * Report what the reduction cost (-v): the time taken by each phase and what it went
+ * through, the sections parsed, the tables built and the memory used.
+ */
+static void
+dump_stats(FILE *fd)
+{
+	struct section_stats *stats;
+	struct mallinfo2 heap = mallinfo2();
+	struct rusage usage;
+	struct rusage children;
+	long lines = 0;
+	long bytes = 0;
+	int phase;
+	int count;
+
+	(void) getrusage(RUSAGE_SELF, &usage);
+	(void) getrusage(RUSAGE_CHILDREN, &children);
+	fprintf(fd, "\n%-24s%12s%12s%16s\n", "phase", "wall (s)", "cpu (s)", "per second");
+	for (phase = 0; phase < NUMBER_PHASES; phase++) {
+		if (phase_stats[phase].wall == 0)
+			continue;
+		fprintf(fd, "%-24s%12.3f%12.3f", phase_names[phase], phase_stats[phase].wall,
+		    phase_stats[phase].cpu);
+		if (phase_stats[phase].items)
+			fprintf(fd, "%16.0f %s", phase_stats[phase].items / phase_stats[phase].wall,
+			    phase == PHASE_DUMP ? "rows" : "stacks");
+		fprintf(fd, "\n");
+	}
+	/* In the order of the sections table, the lines outside them last */
+	for (count = 0; count == 0 || sections[count - 1].title; count++) {
+		stats = &section_stats[SECTION_SLOT(sections[count].title ? sections[count].index : -1)];
+		if (stats->lines == 0)
+			continue;
+		if (lines == 0)
+			fprintf(fd, "%-24s%12s%12s%12s%12s\n", "section", "lines", "bytes", "wall (s)",
+			    "cpu (s)");
+		fprintf(fd, "%-24s%12ld%12ld%12.3f%12.3f\n",
+		    sections[count].title ? sections[count].title : "(no section)",
+		    stats->lines, stats->bytes, (double) stats->wall_ns / 1e9, (double) stats->cpu_ns / 1e9);
+		lines += stats->lines;
+		bytes += stats->bytes;
+	}
+	fprintf(fd, "Parsed %ld lines, %ld bytes (%.1f MB/s) of %ld bytes read\n", lines, bytes,
+	    phase_stats[PHASE_PARSE].wall ? (double) bytes / (1024 * 1024) / phase_stats[PHASE_PARSE].wall : 0,
+	    input_bytes);
+	fprintf(fd, "Unique stacks %zu, frames %zu, callers %zu\n", number_stacks,
+	    number_frame_entries, number_callers);
+	fprintf(fd, "Arena blocks %ld (%ld bytes), heap in use %zu bytes, peak RSS %ld KB\n",
+	    arena_blocks, arena_bytes, heap.uordblks + heap.hblkhd, usage.ru_maxrss);
+	if (children.ru_utime.tv_sec || children.ru_utime.tv_usec)
+		fprintf(fd, "bpftrace and the command, cpu %.3f s\n", timeval_seconds(&children.ru_utime) +
+		    timeval_seconds(&children.ru_stime));
 }
 
+/*
+ * Append the -v stats to file as a JSON object on a line of its own, so the cost of
+ * reducing can be tracked from run to run.  source is what was reduced.
+ */
 static void
-obtain_run_data(char *command, char *file, int interval)
+save_stats(const char *file, const char *source)
 {
-	bpftrace_create(interval);
-	execute_command(command, file);
+	struct section_stats *stats;
+	struct mallinfo2 heap = mallinfo2();
+	struct rusage usage;
+	struct rusage children;
+	FILE *fd;
+	const char *ptr;
+	long lines = 0;
+	long bytes = 0;
+	int phase;
+	int count;
+	int first;
+
+	fd = fopen(file, "a");
+	if (fd == NULL) {
+		perror(file);
+		return;
+	}
+	(void) getrusage(RUSAGE_SELF, &usage);
+	(void) getrusage(RUSAGE_CHILDREN, &children);
+	fprintf(fd, "{\"time\":%ld,\"source\":\"", (long) time(NULL));
+	for (ptr = source; ptr && ptr[0]; ptr++) {
+		if (ptr[0] == '"' || ptr[0] == '\\')
+			fprintf(fd, "\\%c", ptr[0]);
+		else if ((unsigned char) ptr[0] >= 0x20)
+			(void) fputc(ptr[0], fd);
+	}
+	fprintf(fd, "\",\"phases\":{");
+	for (phase = 0; phase < NUMBER_PHASES; phase++)
+		fprintf(fd, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f,\"items\":%.0f}", phase ? "," : "",
+		    phase_names[phase], phase_stats[phase].wall, phase_stats[phase].cpu,
+		    phase_stats[phase].items);
+	fprintf(fd, "},\"sections\":{");
+	for (count = 0, first = 1; count == 0 || sections[count - 1].title; count++) {
+		stats = &section_stats[SECTION_SLOT(sections[count].title ? sections[count].index : -1)];
+		if (stats->lines == 0)
+			continue;
+		fprintf(fd, "%s\"%s\":{\"lines\":%ld,\"bytes\":%ld,\"wall\":%.6f,\"cpu\":%.6f}",
+		    first ? "" : ",", sections[count].title ? sections[count].title : "(no section)",
+		    stats->lines, stats->bytes,
+		    (double) stats->wall_ns / 1e9, (double) stats->cpu_ns / 1e9);
+		lines += stats->lines;
+		bytes += stats->bytes;
+		first = 0;
+	}
+	fprintf(fd, "},\"lines\":%ld,\"bytes\":%ld,\"input_bytes\":%ld,\"stacks\":%zu,\"frames\":%zu,\"callers\":%zu,"
+	    "\"arena_blocks\":%ld,\"arena_bytes\":%ld,\"heap_in_use\":%zu,\"peak_rss_kb\":%ld,"
+	    "\"children_cpu\":%.6f}\n", lines, bytes, input_bytes, number_stacks, number_frame_entries,
+	    number_callers, arena_blocks, arena_bytes, heap.uordblks + heap.hblkhd, usage.ru_maxrss,
+	    timeval_seconds(&children.ru_utime) + timeval_seconds(&children.ru_stime));
+	if (fclose(fd))
+		perror(file);
 }
 
 int
@@ -845,48 +5728,158 @@ main(int argc, char **argv)
 {
 	char *file = NULL;
 	int stack_depth = 1;
+	int last_depth = 1;
+	int depth_given = 0;
 	char value;
 	char *command = NULL;
 	char *caller = NULL;
 	char *output_file = NULL;
+	char *snapshot_file = NULL;
+	char *end;
+	long number;
+	int by_run = 0;
+	size_t capture;
+	size_t candidates;
 	int sort_on = ACQS_SPENT;
+	int secondary_sort_on = -1;
 	int interval = 0;
 	int number_to_show = 999999;
 
-	while ((optind != argc) &&
-	    (value = (char)  getopt(argc, argv, "C:c:f:ho:n:s:S:i:"))) {
+	while ((value = (char) getopt(argc, argv, "b:C:c:D:dF:f:G:g:H:ho:j:k:lm:n:P:pRrs:S:T:ti:V:vw:")) != (char) -1) {
 		switch(value) {
+			case 'b':
+				if (strcmp(optarg, "contention") == 0)
+					trace.backend = BACKEND_CONTENTION;
+				else if (strcmp(optarg, "kprobe") == 0)
+					trace.backend = BACKEND_KPROBE;
+				else {
+					fprintf(stderr, "Unknown backend %s\n", optarg);
+					usage(argv[0]);
+				}
+			break;
 			case 'C':
 				caller = optarg;
 			break;
 			case 'c':
 				command = optarg;
 			break;
+			case 'D':
+				add_capture(optarg, DIFF_BASELINE);
+				report.diff = 1;
+			break;
+			case 'd':
+				trace.squares = 1;
+			break;
+			case 'F':
+				for (report.format = 0; report.format < (int) NUMBER_FORMATS; report.format++) {
+					if (strcmp(optarg, format_names[report.format]) == 0)
+						break;
+				}
+				if (report.format == (int) NUMBER_FORMATS) {
+					fprintf(stderr, "Unknown format %s\n", optarg);
+					usage(argv[0]);
+				}
+			break;
 			case 'f':
-				file = optarg;
+				add_capture(optarg, 0);
+			break;
+			case 'G':
+				trace.cgroup = optarg;
+			break;
+			case 'g':
+				report.folded_file = optarg;
+			break;
+			case 'H':
+				trace.histograms = 1;
+				trace.hist_bits = atoi(optarg);
+				if (trace.hist_bits < 0 || trace.hist_bits > 5) {
+					fprintf(stderr, "Histogram buckets bits must be 0 to 5\n");
+					usage(argv[0]);
+				}
 			break;
 			case 'i':
-				fprintf(stderr,
-				   "Currently interval is not supported, hangs\n");
-#if 0
 				interval = atoi(optarg);
-#endif
+				if (interval < 0)
+					interval = 0;
+			break;
+			case 'j':
+				parse_threads = atoi(optarg);
+				if (parse_threads <= 0)
+					parse_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+				if (parse_threads < 1)
+					parse_threads = 1;
+			break;
+			case 'k':
+				kallsyms_file = optarg;
+			break;
+			case 'l':
+				report.locks = trace.locks = 1;
+			break;
+			case 'm':
+				if (atol(optarg) > 0)
+					hh_budget = atol(optarg);
 			break;
 			case 'n':
 				number_to_show = atoi(optarg);
 			break;
+			case 'P':
+				number = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || number < 1 || number > INT_MAX) {
+					fprintf(stderr, "Sampling (-P) must be a number of at least 1\n");
+					usage(argv[0]);
+				}
+				trace.sample = (int) number;
+			break;
+			case 'p':
+				trace.pid_tree = 1;
+			break;
+			case 'R':
+				by_run = 1;
+			break;
+			case 'r':
+				trace.raw = 1;
+			break;
+			case 'T':
+				trace.threshold = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || trace.threshold < 0) {
+					fprintf(stderr, "Threshold (-T) must be a number of ns, 0 or more\n");
+					usage(argv[0]);
+				}
+			break;
 			case 'o':
 				output_file = optarg;
 			break;
 			case 'S':
 				sort_on = atoi(optarg);
-				if (sort_on > ACQS_SPENT) {
-					fprintf(stderr, "Invalid sort option, defaulting to option 6\n");
+				if (sort_on < 0 || (size_t) sort_on >= NUMBER_SORT_ROUTINES) {
+					fprintf(stderr, "Invalid sort option, defaulting to option %d\n", ACQS_SPENT);
 					sort_on = ACQS_SPENT;
 				}
+				if (strchr(optarg, ',')) {
+					secondary_sort_on = atoi(strchr(optarg, ',') + 1);
+					if (secondary_sort_on < 0 || (size_t) secondary_sort_on >= NUMBER_SORT_ROUTINES) {
+						fprintf(stderr, "Invalid secondary sort option, ignored\n");
+						secondary_sort_on = -1;
+					}
+				}
 			break;
 			case 's':
-				stack_depth = atoi(optarg);
+				stack_depth = last_depth = atoi(optarg);
+				if (strchr(optarg, '-'))
+					last_depth = atoi(strchr(optarg, '-') + 1);
+				depth_given = 1;
+			break;
+			case 't':
+				report.tree = 1;
+			break;
+			case 'V':
+				stats_file = optarg;
+			break;
+			case 'v':
+				verbose = 1;
+			break;
+			case 'w':
+				snapshot_file = optarg;
 			break;
 			case 'h':
 			default:
@@ -895,20 +5888,112 @@ main(int argc, char **argv)
 		}
         }
 
-	if (file == NULL)
-		file = DATA_FILE;
+	/* Any arguments left are captures too, -f host1.out host2.out ... */
+	for (; optind < argc; optind++)
+		add_capture(argv[optind], 0);
+	if (report.diff && (command || interval || by_run || snapshot_file || report.locks || report.tree)) {
+		fprintf(stderr, "-D compares data files, not with -c, -i, -l, -R, -t or -w\n");
+		usage(argv[0]);
+	}
+	if (report.format != FORMAT_TEXT && (report.diff || report.tree)) {
+		fprintf(stderr, "-F is not for the -D or -t reports\n");
+		usage(argv[0]);
+	}
+	for (capture = 0, candidates = 0; capture < number_captures; capture++) {
+		if (report.diff && capture_runs[capture] != DIFF_BASELINE)
+			capture_runs[capture] = DIFF_CANDIDATE;
+		else if (by_run)
+			capture_runs[capture] = capture + 1;
+		if (capture_runs[capture] != DIFF_BASELINE || !report.diff)
+			candidates++;
+	}
+	/* Compared with the default data file, if no other */
+	if (report.diff && candidates == 0)
+		add_capture(DATA_FILE, DIFF_CANDIDATE);
+	if (number_captures)
+		file = capture_files[0];
+	if (number_captures > 1 && (command || interval)) {
+		fprintf(stderr, "Only one data file (-f) with -c or -i\n");
+		usage(argv[0]);
+	}
+	if (by_run && snapshot_file) {
+		fprintf(stderr, "-R and -w are mutually exclusive\n");
+		usage(argv[0]);
+	}
+	if (by_run && command == NULL) {
+		run_names = (const char **) malloc(sizeof (char *) * (number_captures + 2));
+		if (run_names == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		run_names[0] = "";
+		for (capture = 0; capture < number_captures; capture++)
+			run_names[capture + 1] = strrchr(capture_files[capture], '/') ?
+			    strrchr(capture_files[capture], '/') + 1 : capture_files[capture];
+		if (number_captures == 0)
+			run_names[1] = DATA_FILE;
+	}
+
+	report.fd = stdout;
+	if (output_file) {
+		report.fd = fopen(output_file, "w");
+		if (report.fd == NULL) {
+			report.fd = stdout;
+			perror(output_file);
+			fprintf(stderr, "opening %s failed, falling back to stdout\n", output_file);
+		}
+	}
+	if (trace.pid_tree && command == NULL) {
+		fprintf(stderr, "-p requires a command (-c)\n");
+		usage(argv[0]);
+	}
+	if (trace.pid_tree && trace.cgroup) {
+		fprintf(stderr, "-p and -G are mutually exclusive\n");
+		usage(argv[0]);
+	}
+	if (snapshot_file && interval) {
+		fprintf(stderr, "-w is ignored when reporting by interval\n");
+		snapshot_file = NULL;
+	}
+	trace.interval = interval;
+	report.caller = caller;
+	report.sort_option = sort_on;
+	report.secondary_sort = secondary_sort_on;
+	report.numb_to_show = number_to_show;
+	report.first_depth = (stack_depth > 1) ? stack_depth : 1;
+	report.last_depth = (last_depth > report.first_depth) ? last_depth : report.first_depth;
+	report.tree_depth = depth_given ? report.last_depth : 0;
+
 	/*
-	 * Run the command and bpftrace if required.
+	 * Run the command and bpftrace if required, the data is reduced as bpftrace
+	 * produces it.  With an interval and no command or file, trace until interrupted.
+	 * Otherwise reduce the data file.  With an interval, each interval is reported
+	 * as its data is read.
 	 */
-	if (command) {
-		obtain_run_data(command, file, interval);
+	(void) phase_begin(PHASE_PARSE);
+	if (command || (interval && file == NULL)) {
+		obtain_run_data(command, file);
+	} else if (number_captures > 1) {
+		merge_captures();
+		file = "merged captures";
+	} else {
+		if (file == NULL)
+			file = DATA_FILE;
+		lookup_data(file, run_names ? 1 : 0, interval ? report_interval : NULL);
 	}
 	if (interval == 0) {
-		lookup_data(file, stack_depth);
-		/* Everything read in, now organize it */
-		organize_data();
-		/* Dump the data out. */
-		dump_data(output_file, caller, sort_on, number_to_show);
+		(void) phase_begin(PHASE_DUMP);
+		if (snapshot_file)
+			save_snapshot(snapshot_file, command ? command : file);
+		/* Everything read in, now organize it and dump the data out */
+		report_data();
 	}
+	if (report.fd != stdout)
+		(void) fclose(report.fd);
+	(void) phase_begin(-1);
+	if (verbose)
+		dump_stats(stderr);
+	if (stats_file)
+		save_stats(stats_file, command ? command : file);
 	return(0);
 }